@@ -21,7 +21,7 @@
 //   4. The callbacks that implement the actual behavior of the accessory, in
 //   this
 //      case here they merely access the global accessory state variable and
-//      write to the log to make the behavior easily observable.
+//      record a trace event (see Trace.h) to make the behavior observable.
 //
 //   5. The initialization of the accessory state.
 //
@@ -29,10 +29,28 @@
 //   changed.
 
 #include "App.h"
+#include "AsyncWrite.h"
+#include "AttributeIndex.h"
+#include "Button.h"
+#include "Color.h"
 #include "DB.h"
+#include "EventCoalescer.h"
+#include "HeapProfile.h"
+#include "LogKVStore.h"
+#include "Metrics.h"
+#include "Output.h"
+#include "SessionRegistry.h"
+#include "Trace.h"
+#include "Transition.h"
+#include "ValueCache.h"
+#include "WriteBatch.h"
 
+#include "HAP+Internal.h"
+
+#include "frozen.h"
 #include "mgos.h"
 #include "mgos_hap.h"
+#include "mgos_rpc.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -45,24 +63,125 @@
   ((HAPPlatformKeyValueStoreDomain) 0x00)
 
 /**
- * Key used in the key value store to store the configuration state.
+ * Key used in the key value store to store the configuration state of earlier
+ * firmware, one on/off byte per light. Only read to upgrade it.
  *
  * Purged: On factory reset.
  */
 #define kAppKeyValueStoreKey_Configuration_State \
   ((HAPPlatformKeyValueStoreDomain) 0x00)
 
+/**
+ * Key used in the key value store to store the hash of the attribute database
+ * it was last published with, see AttributeDatabaseChanged.
+ *
+ * Purged: On factory reset.
+ */
+#define kAppKeyValueStoreKey_Configuration_AttributeDatabaseHash \
+  ((HAPPlatformKeyValueStoreKey) 0x01)
+
+/**
+ * Key used in the key value store to store the light state (AppState).
+ *
+ * Purged: On factory reset.
+ */
+#define kAppKeyValueStoreKey_Configuration_LightState \
+  ((HAPPlatformKeyValueStoreKey) 0x02)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Maximum number of bridged lights. HAP allows 150 accessories per bridge,
+ * including the bridge itself.
+ */
+#define kAppMaxBridgedLights ((size_t) 149)
+
+/**
+ * Accessory id of the first bridged light. The bridge itself is aid 1.
+ */
+#define kAppFirstBridgedLightAID ((uint64_t) 2)
+
+/**
+ * Persisted state of a light.
+ */
+typedef struct {
+  bool on;
+  uint8_t brightness;         // Percent.
+  uint8_t saturation;         // Percent.
+  bool colorTemperatureMode;  // Last color set was a temperature, not a hue.
+  uint16_t hue;               // Degrees.
+  uint16_t colorTemperature;  // Mireds.
+} AppLightState;
+
+/**
+ * State of a light that has never been set.
+ */
+static const AppLightState kAppLightStateDefault = {
+    .brightness = 100, .colorTemperature = 370};
+
+/**
+ * Version of the persisted state layout.
+ */
+#define kAppStateVersion ((uint8_t) 1)
+
+/**
+ * Persisted state: a header describing the records, then one record per
+ * light. The header, not the length of the value, tells how to read it.
+ */
+typedef struct {
+  uint8_t version;     // kAppStateVersion.
+  uint8_t recordSize;  // sizeof(AppLightState).
+  uint16_t numLights;
+  AppLightState lights[];
+} AppState;
+
+/**
+ * What the actuator of a light has been asked to do and has confirmed.
+ */
+typedef struct {
+  AsyncWriteID latestID;    // Outcomes of earlier writes are ignored.
+  AppLightState driven;     // State of the latest write.
+  bool isRestore;           // Latest write restores the saved state.
+  bool isConfirmed;         // Whether confirmed holds a state yet.
+  AppLightState confirmed;  // Last state confirmed by the actuator.
+} AppActuatorState;
+
+/**
+ * A bridged light.
+ */
+typedef struct {
+  HAPAccessory accessory;
+} AppLight;
+
+/**
+ * Table of lights served by the accessory.
+ *
+ * Built once by AppInitialize. In standalone mode there is a single light
+ * which is part of the top-level accessory, in bridge mode each light is a
+ * bridged accessory with aid kAppFirstBridgedLightAID + index.
+ */
+static struct {
+  size_t numLights;
+  bool isBridge;
+  AppLight *lights;
+  const HAPAccessory *_Nullable *bridgedAccessories;  // NULL-terminated.
+  AppState *state;            // Storage for the accessory state.
+  AppActuatorState *actuators;
+  size_t channelsPerLight;    // Output channels: 1, 3 (RGB) or 4 (RGBW).
+} lightTable;
+
 /**
  * Global accessory configuration.
  */
 typedef struct {
   struct {
-    bool lightBulbOn;
+    AppLightState *lights;  // lightTable.numLights entries.
   } state;
   HAPAccessoryServerRef *server;
   HAPPlatformKeyValueStoreRef keyValueStore;
+  LogKVStoreRef _Nullable stateLog;
+  bool stateDirty;
+  mgos_timer_id saveTimer;
 } AccessoryConfiguration;
 
 static AccessoryConfiguration accessoryConfiguration;
@@ -70,35 +189,83 @@ static AccessoryConfiguration accessoryConfiguration;
 //----------------------------------------------------------------------------------------------------------------------
 
 /**
- * Load the accessory state from persistent memory.
+ * Size of the persisted accessory state.
  */
-static void LoadAccessoryState(void) {
-  HAPPrecondition(accessoryConfiguration.keyValueStore);
+static size_t AccessoryStateNumBytes(void) {
+  return sizeof(AppState) +
+         lightTable.numLights * sizeof accessoryConfiguration.state.lights[0];
+}
 
+/**
+ * Get a value of the configuration domain, from the state log if there is
+ * one. A value found in the key-value store instead is moved to the log: it
+ * is only removed from the key-value store once the log holds it.
+ *
+ * @return true if found, false otherwise.
+ */
+static bool GetConfigurationValue(HAPPlatformKeyValueStoreKey key,
+                                  void *bytes, size_t maxBytes,
+                                  size_t *numBytes) {
   HAPError err;
-
-  // Load persistent state if available
-  bool found;
-  size_t numBytes;
-
-  err = HAPPlatformKeyValueStoreGet(
-      accessoryConfiguration.keyValueStore,
-      kAppKeyValueStoreDomain_Configuration,
-      kAppKeyValueStoreKey_Configuration_State, &accessoryConfiguration.state,
-      sizeof accessoryConfiguration.state, &numBytes, &found);
-
+  bool found = false;
+  if (accessoryConfiguration.stateLog) {
+    err = LogKVStoreGet(accessoryConfiguration.stateLog,
+                        kAppKeyValueStoreDomain_Configuration, key, bytes,
+                        maxBytes, numBytes, &found);
+    if (err) {
+      HAPAssert(err == kHAPError_Unknown);
+      HAPFatalError();
+    }
+    if (found) {
+      return true;
+    }
+  }
+  err = HAPPlatformKeyValueStoreGet(accessoryConfiguration.keyValueStore,
+                                    kAppKeyValueStoreDomain_Configuration, key,
+                                    bytes, maxBytes, numBytes, &found);
   if (err) {
     HAPAssert(err == kHAPError_Unknown);
     HAPFatalError();
   }
-  if (!found || numBytes != sizeof accessoryConfiguration.state) {
-    if (found) {
-      HAPLogError(&kHAPLog_Default,
-                  "Unexpected app state found in key-value store. Resetting to "
-                  "default.");
+  if (found && accessoryConfiguration.stateLog) {
+    // Migrate state written by an earlier firmware to the log.
+    HAPLogInfo(&kHAPLog_Default, "Moving app state to the state log.");
+    err = LogKVStoreSet(accessoryConfiguration.stateLog,
+                        kAppKeyValueStoreDomain_Configuration, key, bytes,
+                        *numBytes);
+    if (err) {
+      HAPAssert(err == kHAPError_Unknown);
+      HAPFatalError();
     }
-    HAPRawBufferZero(&accessoryConfiguration.state,
-                     sizeof accessoryConfiguration.state);
+    err = HAPPlatformKeyValueStoreRemove(accessoryConfiguration.keyValueStore,
+                                         kAppKeyValueStoreDomain_Configuration,
+                                         key);
+    if (err) {
+      HAPAssert(err == kHAPError_Unknown);
+      HAPFatalError();
+    }
+  }
+  return found;
+}
+
+/**
+ * Remove the on/off state of earlier firmware once it has been upgraded.
+ */
+static void RemoveOnOffAccessoryState(void) {
+  HAPError err;
+  if (accessoryConfiguration.stateLog) {
+    err = LogKVStoreRemove(accessoryConfiguration.stateLog,
+                           kAppKeyValueStoreDomain_Configuration,
+                           kAppKeyValueStoreKey_Configuration_State);
+  } else {
+    err = HAPPlatformKeyValueStoreRemove(
+        accessoryConfiguration.keyValueStore,
+        kAppKeyValueStoreDomain_Configuration,
+        kAppKeyValueStoreKey_Configuration_State);
+  }
+  if (err) {
+    HAPAssert(err == kHAPError_Unknown);
+    HAPFatalError();
   }
 }
 
@@ -108,22 +275,156 @@ static void LoadAccessoryState(void) {
 static void SaveAccessoryState(void) {
   HAPPrecondition(accessoryConfiguration.keyValueStore);
 
+  HEAP_PROFILE_BEGIN(kHeapProfileSite_StateSave, NULL);
+  int64_t startUs = MetricsNow();
   HAPError err;
-  err = HAPPlatformKeyValueStoreSet(accessoryConfiguration.keyValueStore,
-                                    kAppKeyValueStoreDomain_Configuration,
-                                    kAppKeyValueStoreKey_Configuration_State,
-                                    &accessoryConfiguration.state,
-                                    sizeof accessoryConfiguration.state);
+  if (accessoryConfiguration.stateLog) {
+    err = LogKVStoreSet(accessoryConfiguration.stateLog,
+                        kAppKeyValueStoreDomain_Configuration,
+                        kAppKeyValueStoreKey_Configuration_LightState,
+                        lightTable.state, AccessoryStateNumBytes());
+  } else {
+    err = HAPPlatformKeyValueStoreSet(
+        accessoryConfiguration.keyValueStore,
+        kAppKeyValueStoreDomain_Configuration,
+        kAppKeyValueStoreKey_Configuration_LightState, lightTable.state,
+        AccessoryStateNumBytes());
+  }
   if (err) {
     HAPAssert(err == kHAPError_Unknown);
     HAPFatalError();
   }
+  MetricsRecordLatency(kMetricsHistogram_StateSave, startUs);
+  MetricsIncrement(kMetricsCounter_StateSaves);
+  MetricsAdd(kMetricsCounter_StateSaveBytes, AccessoryStateNumBytes());
+  HEAP_PROFILE_END(kHeapProfileSite_StateSave, NULL);
+}
+
+/**
+ * Load the accessory state from persistent memory.
+ *
+ * Lights missing from the stored state, e.g. added to the bridge table
+ * since, start from kAppLightStateDefault. On/off state of earlier firmware
+ * is saved in the current format before it is removed.
+ */
+static void LoadAccessoryState(void) {
+  HAPPrecondition(accessoryConfiguration.keyValueStore);
+
+  AppState *state = lightTable.state;
+  AppLightState *lights = state->lights;
+  size_t numLoaded = 0;
+  size_t numBytes;
+  bool upgraded = false;
+  if (GetConfigurationValue(kAppKeyValueStoreKey_Configuration_LightState,
+                            state, AccessoryStateNumBytes(), &numBytes)) {
+    if (numBytes < sizeof *state || state->version != kAppStateVersion ||
+        state->recordSize != sizeof *lights) {
+      HAPLogError(&kHAPLog_Default,
+                  "Unexpected app state found in key-value store. Resetting to "
+                  "default.");
+    } else {
+      // The read stops at our number of lights.
+      numLoaded = (numBytes - sizeof *state) / sizeof *lights;
+      if (numLoaded > state->numLights) {
+        numLoaded = state->numLights;
+      }
+    }
+  } else if (GetConfigurationValue(kAppKeyValueStoreKey_Configuration_State,
+                                   lights, lightTable.numLights, &numBytes)) {
+    // Expand in place, from the back: lights[i] starts at or after byte i.
+    HAPLogInfo(&kHAPLog_Default, "Upgrading on/off app state.");
+    numLoaded = numBytes;
+    for (size_t i = numLoaded; i-- > 0;) {
+      bool on = ((const uint8_t *) lights)[i] != 0;
+      lights[i] = kAppLightStateDefault;
+      lights[i].on = on;
+    }
+    upgraded = true;
+  }
+  for (size_t i = numLoaded; i < lightTable.numLights; i++) {
+    lights[i] = kAppLightStateDefault;
+  }
+  state->version = kAppStateVersion;
+  state->recordSize = (uint8_t) sizeof *lights;
+  state->numLights = (uint16_t) lightTable.numLights;
+  if (upgraded) {
+    SaveAccessoryState();
+    RemoveOnOffAccessoryState();
+  }
+}
+
+static void SaveAccessoryStateTimerCallback(void *arg HAP_UNUSED) {
+  accessoryConfiguration.saveTimer = MGOS_INVALID_TIMER_ID;
+  AppFlushAccessoryState();
+}
+
+/**
+ * Mark the accessory state as modified.
+ *
+ * The state is written out when the save timer expires. The timer is not
+ * re-armed by subsequent changes, so all changes made within the window are
+ * coalesced into a single write and the persisted state is never more than
+ * lightbulb.save_delay_ms behind. With a delay of 0 the timer fires on the
+ * next main loop iteration, which still folds all changes made by one request
+ * into one write.
+ */
+static void MarkAccessoryStateDirty(void) {
+  accessoryConfiguration.stateDirty = true;
+  if (accessoryConfiguration.saveTimer != MGOS_INVALID_TIMER_ID) {
+    return;
+  }
+  int delayMs = mgos_sys_config_get_lightbulb_save_delay_ms();
+  if (delayMs < 0) {
+    delayMs = 0;
+  }
+  accessoryConfiguration.saveTimer =
+      mgos_set_timer(delayMs, 0, SaveAccessoryStateTimerCallback, NULL);
+}
+
+void AppFlushAccessoryState(void) {
+  if (accessoryConfiguration.saveTimer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(accessoryConfiguration.saveTimer);
+    accessoryConfiguration.saveTimer = MGOS_INVALID_TIMER_ID;
+  }
+  if (!accessoryConfiguration.stateDirty) {
+    return;
+  }
+  SaveAccessoryState();
+  accessoryConfiguration.stateDirty = false;
+}
+
+static void AppRebootHandler(int ev HAP_UNUSED, void *ev_data HAP_UNUSED,
+                             void *userdata HAP_UNUSED) {
+  AppFlushAccessoryState();
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
 /**
- * HomeKit accessory that provides the Light Bulb service.
+ * Services of the top-level accessory in standalone mode.
+ */
+static const HAPService *const lightBulbAccessoryServices[] = {
+    &mgos_hap_accessory_information_service,
+    &mgos_hap_protocol_information_service, &mgos_hap_pairing_service,
+    &lightBulbService, NULL};
+
+/**
+ * Services of the top-level accessory in bridge mode.
+ */
+static const HAPService *const bridgeAccessoryServices[] = {
+    &mgos_hap_accessory_information_service,
+    &mgos_hap_protocol_information_service, &mgos_hap_pairing_service, NULL};
+
+/**
+ * Services of a bridged light. Shared by all bridged lights, the per-light
+ * name is served by HandleLightBulbNameRead.
+ */
+static const HAPService *const bridgedLightServices[] = {
+    &mgos_hap_accessory_information_service, &lightBulbService, NULL};
+
+/**
+ * HomeKit accessory that provides the Light Bulb service, or the bridge in
+ * bridge mode.
  *
  * Note: Not constant to enable BCT Manual Name Change.
  */
@@ -136,11 +437,7 @@ static HAPAccessory accessory = {
     .serialNumber = NULL,     // Set from config.
     .firmwareVersion = NULL,  // Set from build_id.
     .hardwareVersion = CS_STRINGIFY_MACRO(HAP_PRODUCT_HW_REV),
-    .services =
-        (const HAPService *const[]){&mgos_hap_accessory_information_service,
-                                    &mgos_hap_protocol_information_service,
-                                    &mgos_hap_pairing_service,
-                                    &lightBulbService, NULL},
+    .services = lightBulbAccessoryServices,
     .callbacks = {.identify = IdentifyAccessory}};
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -154,31 +451,415 @@ HAPError IdentifyAccessory(HAPAccessoryServerRef *server HAP_UNUSED,
   return kHAPError_None;
 }
 
+/**
+ * Index of the light represented by an accessory.
+ */
+static size_t LightIndex(const HAPAccessory *accessory) {
+  if (!lightTable.isBridge) {
+    return 0;
+  }
+  HAPPrecondition(accessory->aid >= kAppFirstBridgedLightAID);
+  size_t index = (size_t)(accessory->aid - kAppFirstBridgedLightAID);
+  HAPPrecondition(index < lightTable.numLights);
+  return index;
+}
+
+/**
+ * Accessory representing a light.
+ */
+static const HAPAccessory *LightAccessory(size_t index) {
+  HAPPrecondition(index < lightTable.numLights);
+  return (lightTable.isBridge ? &lightTable.lights[index].accessory
+                              : &accessory);
+}
+
+/**
+ * Publish the state of a light to the value cache.
+ */
+static void PublishLight(size_t index) {
+  const HAPAccessory *a = LightAccessory(index);
+  const AppLightState *light = &accessoryConfiguration.state.lights[index];
+  ValueCachePublishBool(a, &lightBulbOnCharacteristic, light->on);
+  ValueCachePublishInt(a, &lightBulbBrightnessCharacteristic,
+                       light->brightness);
+  ValueCachePublishFloat(a, &lightBulbHueCharacteristic, light->hue);
+  ValueCachePublishFloat(a, &lightBulbSaturationCharacteristic,
+                         light->saturation);
+  ValueCachePublishUInt32(a, &lightBulbColorTemperatureCharacteristic,
+                          light->colorTemperature);
+}
+
+/**
+ * Publish the state of all lights to the value cache.
+ */
+static void PublishLightState(void) {
+  for (size_t i = 0; i < lightTable.numLights; i++) {
+    PublishLight(i);
+  }
+}
+
+/**
+ * Account for a characteristic read handled since startUs.
+ */
+static void RecordRead(HAPSessionRef *session, int64_t startUs) {
+  MetricsIncrement(kMetricsCounter_Reads);
+  MetricsRecordLatency(kMetricsHistogram_Read, startUs);
+  SessionRegistryRecordRequest(session, startUs);
+}
+
+/**
+ * Account for a characteristic write handled since startUs.
+ */
+static void RecordWrite(HAPSessionRef *session, int64_t startUs) {
+  MetricsIncrement(kMetricsCounter_Writes);
+  MetricsRecordLatency(kMetricsHistogram_Write, startUs);
+  SessionRegistryRecordRequest(session, startUs);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbNameRead(
+    HAPAccessoryServerRef *server HAP_UNUSED,
+    const HAPStringCharacteristicReadRequest *request, char *value,
+    size_t maxValueBytes, void *_Nullable context HAP_UNUSED) {
+  const char *name =
+      (lightTable.isBridge ? request->accessory->name
+                           : mgos_sys_config_get_lightbulb_name());
+  size_t numBytes = strlen(name);
+  if (numBytes >= maxValueBytes) {
+    return kHAPError_OutOfResources;
+  }
+  HAPRawBufferCopyBytes(value, name, numBytes + 1);
+
+  return kHAPError_None;
+}
+
+/**
+ * Value of the On characteristic of a light: from the value cache or, on a
+ * miss, from the state.
+ */
+static bool ReadLightOn(const HAPAccessory *accessory,
+                        const HAPCharacteristic *characteristic,
+                        size_t index) {
+  bool value;
+  if (!ValueCacheReadBool(accessory, characteristic, &value)) {
+    value = accessoryConfiguration.state.lights[index].on;
+  }
+  return value;
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleLightBulbOnRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
-    const HAPBoolCharacteristicReadRequest *request HAP_UNUSED, bool *value,
+    const HAPBoolCharacteristicReadRequest *request, bool *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = accessoryConfiguration.state.lightBulbOn;
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, *value ? "true" : "false");
+  int64_t startUs = MetricsNow();
+  size_t index = LightIndex(request->accessory);
+  *value = ReadLightOn(request->accessory, request->characteristic, index);
+  TRACE(kTraceEvent_LightBulbOnRead, (index << 1) | *value);
+  RecordRead(request->session, startUs);
 
   return kHAPError_None;
 }
 
+/**
+ * Raise events for the characteristics of a light that differ from before.
+ */
+static void RaiseLightChanges(size_t index, const AppLightState *before) {
+  const AppLightState *light = &accessoryConfiguration.state.lights[index];
+  const HAPCharacteristic *changed[5];
+  size_t numChanged = 0;
+  if (light->on != before->on) {
+    changed[numChanged++] = &lightBulbOnCharacteristic;
+  }
+  if (light->brightness != before->brightness) {
+    changed[numChanged++] = &lightBulbBrightnessCharacteristic;
+  }
+  if (light->hue != before->hue) {
+    changed[numChanged++] = &lightBulbHueCharacteristic;
+  }
+  if (light->saturation != before->saturation) {
+    changed[numChanged++] = &lightBulbSaturationCharacteristic;
+  }
+  if (light->colorTemperature != before->colorTemperature) {
+    changed[numChanged++] = &lightBulbColorTemperatureCharacteristic;
+  }
+  for (size_t i = 0; i < numChanged; i++) {
+    EventCoalescerRaise(accessoryConfiguration.server, changed[i],
+                        &lightBulbService, LightAccessory(index));
+  }
+}
+
+/**
+ * Handle the outcome of driving a light: persist the new state, or roll back
+ * to what the actuator last confirmed and tell the controllers. Only the
+ * latest write of a light counts; earlier ones have been superseded.
+ */
+static void LightDriven(size_t index, AsyncWriteID id, HAPError status) {
+  AppActuatorState *actuator = &lightTable.actuators[index];
+  if (id != actuator->latestID) {
+    return;  // Superseded by a later write.
+  }
+  if (status == kHAPError_None) {
+    actuator->confirmed = actuator->driven;
+    actuator->isConfirmed = true;
+    if (!actuator->isRestore) {
+      MarkAccessoryStateDirty();
+    }
+    return;
+  }
+  LOG(LL_ERROR, ("Light %u: actuator failed (%d)", (unsigned) index,
+                 (int) status));
+  if (!actuator->isConfirmed) {
+    return;  // Nothing known to roll back to.
+  }
+  AppLightState *light = &accessoryConfiguration.state.lights[index];
+  AppLightState before = *light;
+  *light = actuator->confirmed;
+  if (AttributeIndexGetCount() == 0) {
+    return;  // Server not running, nobody to notify.
+  }
+  PublishLight(index);
+  RaiseLightChanges(index, &before);
+}
+
+static void LightDriveDone(AsyncWriteID id, HAPError status,
+                           void *_Nullable context) {
+  LightDriven((size_t)(uintptr_t) context, id, status);
+}
+
+/**
+ * Perceived level of each output channel of a light.
+ */
+static void LightLevels(const AppLightState *light,
+                        uint16_t levels[kColorChannel_Count]) {
+  uint16_t level =
+      (light->on ? (uint16_t)(light->brightness * kOutput_LevelMax / 100) : 0);
+  if (lightTable.channelsPerLight == 1) {
+    levels[0] = level;
+    return;
+  }
+  if (light->colorTemperatureMode) {
+    ColorTemperatureToRGBW(light->colorTemperature, level, levels);
+  } else {
+    ColorHSVToRGBW(light->hue, light->saturation, level, levels);
+  }
+  if (lightTable.channelsPerLight == 3) {
+    // No white channel: mix white from RGB.
+    for (size_t k = 0; k < 3; k++) {
+      uint32_t sum = (uint32_t) levels[k] + levels[kColorChannel_White];
+      levels[k] = (uint16_t)(sum < kOutput_LevelMax ? sum : kOutput_LevelMax);
+    }
+  }
+}
+
+/**
+ * Drive a light to its current state. Only starts the change, see
+ * Transition.h; the outcome is handled by LightDriven.
+ */
+static void DriveLight(size_t index) {
+  const AppLightState *light = &accessoryConfiguration.state.lights[index];
+  AppActuatorState *actuator = &lightTable.actuators[index];
+  // The write completes at the end of the fade.
+  uint32_t timeoutMs =
+      (uint32_t)(mgos_sys_config_get_app_actuator_timeout_ms() +
+                 mgos_sys_config_get_app_transition_ms());
+  AsyncWriteID id =
+      AsyncWriteStart(timeoutMs, LightDriveDone, (void *) (uintptr_t) index);
+  actuator->latestID = id;
+  actuator->driven = *light;
+  actuator->isRestore = false;
+  if (id == 0) {
+    LightDriven(index, id, kHAPError_OutOfResources);
+    return;
+  }
+  uint16_t levels[kColorChannel_Count];
+  LightLevels(light, levels);
+  TransitionStart(index * lightTable.channelsPerLight, levels,
+                  lightTable.channelsPerLight, id);
+}
+
+/**
+ * Commit the writes of one request to a light: drive the light and notify
+ * the other controllers. The state is persisted once the light has been
+ * driven.
+ */
+static void CommitLightBulbWrites(HAPAccessoryServerRef *server,
+                                  const WriteBatchTransaction *transaction,
+                                  void *_Nullable context HAP_UNUSED) {
+  size_t index = LightIndex(transaction->accessory);
+  DriveLight(index);
+  for (size_t i = 0; i < transaction->numCharacteristics; i++) {
+    EventCoalescerRaise(server, transaction->characteristics[i],
+                        transaction->service, transaction->accessory);
+  }
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleLightBulbOnWrite(
     HAPAccessoryServerRef *server,
     const HAPBoolCharacteristicWriteRequest *request, bool value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, value ? "true" : "false");
-  if (accessoryConfiguration.state.lightBulbOn != value) {
-    accessoryConfiguration.state.lightBulbOn = value;
+  int64_t startUs = MetricsNow();
+  size_t index = LightIndex(request->accessory);
+  TRACE(kTraceEvent_LightBulbOnWrite, (index << 1) | value);
+  if (accessoryConfiguration.state.lights[index].on != value) {
+    accessoryConfiguration.state.lights[index].on = value;
+    ValueCachePublishBool(request->accessory, request->characteristic, value);
 
-    SaveAccessoryState();
+    WriteBatchAdd(server, request->accessory, request->service,
+                  request->characteristic, CommitLightBulbWrites, NULL);
+  }
+  RecordWrite(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbBrightnessRead(
+    HAPAccessoryServerRef *server HAP_UNUSED,
+    const HAPIntCharacteristicReadRequest *request, int32_t *value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  if (!ValueCacheReadInt(request->accessory, request->characteristic, value)) {
+    size_t index = LightIndex(request->accessory);
+    *value = accessoryConfiguration.state.lights[index].brightness;
+  }
+  RecordRead(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbBrightnessWrite(
+    HAPAccessoryServerRef *server,
+    const HAPIntCharacteristicWriteRequest *request, int32_t value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  AppLightState *light =
+      &accessoryConfiguration.state.lights[LightIndex(request->accessory)];
+  if (light->brightness != value) {
+    light->brightness = (uint8_t) value;
+    ValueCachePublishInt(request->accessory, request->characteristic, value);
+
+    WriteBatchAdd(server, request->accessory, request->service,
+                  request->characteristic, CommitLightBulbWrites, NULL);
+  }
+  RecordWrite(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbHueRead(
+    HAPAccessoryServerRef *server HAP_UNUSED,
+    const HAPFloatCharacteristicReadRequest *request, float *value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  if (!ValueCacheReadFloat(request->accessory, request->characteristic,
+                           value)) {
+    size_t index = LightIndex(request->accessory);
+    *value = accessoryConfiguration.state.lights[index].hue;
+  }
+  RecordRead(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbHueWrite(
+    HAPAccessoryServerRef *server,
+    const HAPFloatCharacteristicWriteRequest *request, float value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  AppLightState *light =
+      &accessoryConfiguration.state.lights[LightIndex(request->accessory)];
+  uint16_t hue = (uint16_t)(value + 0.5f);
+  if (light->hue != hue || light->colorTemperatureMode) {
+    light->hue = hue;
+    light->colorTemperatureMode = false;
+    ValueCachePublishFloat(request->accessory, request->characteristic, hue);
+
+    WriteBatchAdd(server, request->accessory, request->service,
+                  request->characteristic, CommitLightBulbWrites, NULL);
+  }
+  RecordWrite(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbSaturationRead(
+    HAPAccessoryServerRef *server HAP_UNUSED,
+    const HAPFloatCharacteristicReadRequest *request, float *value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  if (!ValueCacheReadFloat(request->accessory, request->characteristic,
+                           value)) {
+    size_t index = LightIndex(request->accessory);
+    *value = accessoryConfiguration.state.lights[index].saturation;
+  }
+  RecordRead(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbSaturationWrite(
+    HAPAccessoryServerRef *server,
+    const HAPFloatCharacteristicWriteRequest *request, float value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  AppLightState *light =
+      &accessoryConfiguration.state.lights[LightIndex(request->accessory)];
+  uint8_t saturation = (uint8_t)(value + 0.5f);
+  if (light->saturation != saturation || light->colorTemperatureMode) {
+    light->saturation = saturation;
+    light->colorTemperatureMode = false;
+    ValueCachePublishFloat(request->accessory, request->characteristic,
+                           saturation);
+
+    WriteBatchAdd(server, request->accessory, request->service,
+                  request->characteristic, CommitLightBulbWrites, NULL);
+  }
+  RecordWrite(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbColorTemperatureRead(
+    HAPAccessoryServerRef *server HAP_UNUSED,
+    const HAPUInt32CharacteristicReadRequest *request, uint32_t *value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  if (!ValueCacheReadUInt32(request->accessory, request->characteristic,
+                            value)) {
+    size_t index = LightIndex(request->accessory);
+    *value = accessoryConfiguration.state.lights[index].colorTemperature;
+  }
+  RecordRead(request->session, startUs);
+
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbColorTemperatureWrite(
+    HAPAccessoryServerRef *server,
+    const HAPUInt32CharacteristicWriteRequest *request, uint32_t value,
+    void *_Nullable context HAP_UNUSED) {
+  int64_t startUs = MetricsNow();
+  AppLightState *light =
+      &accessoryConfiguration.state.lights[LightIndex(request->accessory)];
+  if (light->colorTemperature != value || !light->colorTemperatureMode) {
+    light->colorTemperature = (uint16_t) value;
+    light->colorTemperatureMode = true;
+    ValueCachePublishUInt32(request->accessory, request->characteristic,
+                            value);
 
-    HAPAccessoryServerRaiseEvent(server, request->characteristic,
-                                 request->service, request->accessory);
+    WriteBatchAdd(server, request->accessory, request->service,
+                  request->characteristic, CommitLightBulbWrites, NULL);
   }
+  RecordWrite(request->session, startUs);
 
   return kHAPError_None;
 }
@@ -191,28 +872,198 @@ void AccessoryNotification(const HAPAccessory *accessory,
                            void *ctx HAP_UNUSED) {
   HAPLogInfo(&kHAPLog_Default, "Accessory Notification");
 
-  HAPAccessoryServerRaiseEvent(accessoryConfiguration.server, characteristic,
-                               service, accessory);
+  EventCoalescerRaise(accessoryConfiguration.server, characteristic, service,
+                      accessory);
+}
+
+/**
+ * Set a light from the button: drive it and notify the controllers.
+ */
+static void SetLightFromButton(size_t index, bool on) {
+  if (accessoryConfiguration.state.lights[index].on == on) {
+    return;
+  }
+  accessoryConfiguration.state.lights[index].on = on;
+  DriveLight(index);
+  if (AttributeIndexGetCount() == 0) {
+    return;  // Server not running, nobody to notify.
+  }
+  // Rolled back already if the light could not be driven.
+  ValueCachePublishBool(LightAccessory(index), &lightBulbOnCharacteristic,
+                        accessoryConfiguration.state.lights[index].on);
+  AccessoryNotification(LightAccessory(index), &lightBulbService,
+                        &lightBulbOnCharacteristic, NULL);
+}
+
+/**
+ * Button actions: a single press toggles app.button.light, a double press
+ * turns all lights on and a long press turns them all off.
+ */
+static void HandleButtonPress(ButtonPress press, int64_t edgeUs) {
+  if (accessoryConfiguration.server == NULL) {
+    return;  // Not created yet.
+  }
+  TRACE(kTraceEvent_ButtonPress, press);
+  switch (press) {
+    case kButtonPress_Single: {
+      int light = mgos_sys_config_get_app_button_light();
+      if (light < 0 || (size_t) light >= lightTable.numLights) {
+        LOG(LL_ERROR, ("Button: no light %d", light));
+        return;
+      }
+      SetLightFromButton((size_t) light,
+                         !accessoryConfiguration.state.lights[light].on);
+      break;
+    }
+    case kButtonPress_Double:
+    case kButtonPress_Long:
+      for (size_t i = 0; i < lightTable.numLights; i++) {
+        SetLightFromButton(i, press == kButtonPress_Double);
+      }
+      break;
+  }
+  MetricsIncrement(kMetricsCounter_ButtonPresses);
+  MetricsRecordLatency(kMetricsHistogram_Button, edgeUs);
 }
 
 void AppCreate(HAPAccessoryServerRef *server,
-               HAPPlatformKeyValueStoreRef keyValueStore) {
+               HAPPlatformKeyValueStoreRef keyValueStore,
+               LogKVStoreRef _Nullable stateLog) {
   HAPPrecondition(server);
   HAPPrecondition(keyValueStore);
 
   HAPLogInfo(&kHAPLog_Default, "%s", __func__);
+  HEAP_PROFILE_BEGIN(kHeapProfileSite_AppCreate, NULL);
 
   HAPRawBufferZero(&accessoryConfiguration, sizeof accessoryConfiguration);
   accessoryConfiguration.server = server;
   accessoryConfiguration.keyValueStore = keyValueStore;
+  accessoryConfiguration.stateLog = stateLog;
+  accessoryConfiguration.state.lights = lightTable.state->lights;
   LoadAccessoryState();
+  // The outputs start at 0: drive them to the saved state. Nothing is
+  // confirmed until the actuators report back.
+  HAPRawBufferZero(lightTable.actuators,
+                   lightTable.numLights * sizeof *lightTable.actuators);
+  for (size_t i = 0; i < lightTable.numLights; i++) {
+    DriveLight(i);
+    lightTable.actuators[i].isRestore = true;
+  }
+  HEAP_PROFILE_END(kHeapProfileSite_AppCreate, NULL);
 }
 
 void AppRelease(void) {
+  WriteBatchFlush();
+  AppFlushAccessoryState();
+  EventCoalescerReset();
+  ValueCacheRelease();
+  AttributeIndexRelease();
+}
+
+/**
+ * FNV-1a hash of bytes, continued from hash.
+ */
+static uint32_t HashBytes(uint32_t hash, const void *bytes, size_t numBytes) {
+  const uint8_t *b = bytes;
+  for (size_t i = 0; i < numBytes; i++) {
+    hash = (hash ^ b[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t HashUInt64(uint32_t hash, uint64_t value) {
+  for (size_t i = 0; i < sizeof value; i++) {
+    uint8_t b = (uint8_t)(value >> (8 * i));
+    hash = HashBytes(hash, &b, 1);
+  }
+  return hash;
+}
+
+/**
+ * Hash what controllers cache of an accessory: its aid and name, and the
+ * iid, type, format and permissions of every service and characteristic.
+ */
+static uint32_t HashAccessory(uint32_t hash, const HAPAccessory *a) {
+  hash = HashUInt64(hash, a->aid);
+  hash = HashBytes(hash, a->name, strlen(a->name) + 1);
+  for (const HAPService *const *s = a->services; *s != NULL; s++) {
+    hash = HashUInt64(hash, (*s)->iid);
+    hash = HashBytes(hash, (*s)->serviceType, sizeof *(*s)->serviceType);
+    for (const HAPCharacteristic *const *c = (*s)->characteristics;
+         *c != NULL; c++) {
+      const HAPBaseCharacteristic *bc = (const HAPBaseCharacteristic *) *c;
+      uint8_t bits[4] = {(uint8_t) bc->format, bc->properties.readable,
+                         bc->properties.writable,
+                         bc->properties.supportsEventNotification};
+      hash = HashUInt64(hash, bc->iid);
+      hash = HashBytes(hash, bc->characteristicType,
+                       sizeof *bc->characteristicType);
+      hash = HashBytes(hash, bits, sizeof bits);
+    }
+  }
+  return hash;
+}
+
+/**
+ * Check whether the attribute database differs from the one it was last
+ * published with, and remember the current one. Covers the mode (standalone
+ * or bridge), the bridged lights and the services and characteristics of
+ * every accessory, so a firmware that adds characteristics counts as a
+ * change too.
+ *
+ * Controllers cache the attribute database until the configuration number
+ * changes, so it must only be bumped on actual changes: a needless bump makes
+ * every controller refetch /accessories after each reboot.
+ */
+static bool AttributeDatabaseChanged(void) {
+  uint8_t isBridge = lightTable.isBridge;
+  uint32_t hash = HashBytes(2166136261u, &isBridge, sizeof isBridge);
+  hash = HashAccessory(hash, &accessory);
+  for (size_t i = 0; lightTable.isBridge && i < lightTable.numLights; i++) {
+    hash = HashAccessory(hash, &lightTable.lights[i].accessory);
+  }
+
+  HAPError err;
+  uint32_t storedHash;
+  size_t numBytes;
+  bool found;
+  err = HAPPlatformKeyValueStoreGet(
+      accessoryConfiguration.keyValueStore,
+      kAppKeyValueStoreDomain_Configuration,
+      kAppKeyValueStoreKey_Configuration_AttributeDatabaseHash, &storedHash,
+      sizeof storedHash, &numBytes, &found);
+  if (err) {
+    HAPAssert(err == kHAPError_Unknown);
+    HAPFatalError();
+  }
+  if (found && numBytes == sizeof storedHash && storedHash == hash) {
+    return false;
+  }
+  err = HAPPlatformKeyValueStoreSet(
+      accessoryConfiguration.keyValueStore,
+      kAppKeyValueStoreDomain_Configuration,
+      kAppKeyValueStoreKey_Configuration_AttributeDatabaseHash, &hash,
+      sizeof hash);
+  if (err) {
+    HAPAssert(err == kHAPError_Unknown);
+    HAPFatalError();
+  }
+  HAPLogInfo(&kHAPLog_Default, "Attribute database changed.");
+  return true;
 }
 
 void AppAccessoryServerStart(void) {
-  HAPAccessoryServerStart(accessoryConfiguration.server, &accessory);
+  AttributeIndexBuild(&accessory,
+                      lightTable.isBridge ? lightTable.bridgedAccessories
+                                          : NULL);
+  ValueCacheCreate();
+  PublishLightState();
+  // Started as a bridge without bridged accessories in standalone mode, the
+  // only way to bump the configuration number there too.
+  HAPAccessoryServerStartBridge(
+      accessoryConfiguration.server, &accessory,
+      lightTable.isBridge ? lightTable.bridgedAccessories : NULL,
+      AttributeDatabaseChanged());
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -241,17 +1092,289 @@ void AccessoryServerHandleUpdatedState(HAPAccessoryServerRef *server,
   HAPFatalError();
 }
 
+void AccessoryServerHandleSessionAccept(HAPAccessoryServerRef *server,
+                                        HAPSessionRef *session,
+                                        void *_Nullable context HAP_UNUSED) {
+  HAPPrecondition(server);
+  HAPPrecondition(session);
+
+  HEAP_PROFILE_BEGIN(kHeapProfileSite_Session, session);
+  SessionRegistryAccept(session);
+}
+
+void AccessoryServerHandleSessionInvalidate(HAPAccessoryServerRef *server,
+                                            HAPSessionRef *session,
+                                            void *_Nullable context
+                                                HAP_UNUSED) {
+  HAPPrecondition(server);
+  HAPPrecondition(session);
+
+  SessionRegistryInvalidate(session);
+  HEAP_PROFILE_END(kHeapProfileSite_Session, session);
+}
+
 HAPAccessory *AppGetAccessoryInfo() {
   return &accessory;
 }
 
+size_t AppGetAttributeCount(void) {
+  size_t count = 0;
+  for (size_t i = 0;; i++) {
+    const HAPAccessory *a =
+        (i == 0 ? &accessory
+                : (lightTable.isBridge ? lightTable.bridgedAccessories[i - 1]
+                                       : NULL));
+    if (a == NULL) break;
+    for (const HAPService *const *s = a->services; *s != NULL; s++) {
+      count++;
+      for (const HAPCharacteristic *const *c = (*s)->characteristics;
+           *c != NULL; c++) {
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * App.Notify RPC: raise an event for the characteristic {aid, iid}, as if its
+ * value had changed.
+ */
+static void AppNotifyRPCHandler(struct mg_rpc_request_info *ri,
+                                void *cb_arg HAP_UNUSED,
+                                struct mg_rpc_frame_info *fi HAP_UNUSED,
+                                struct mg_str args) {
+  int aid = 1, iid = -1;
+  json_scanf(args.p, args.len, ri->args_fmt, &aid, &iid);
+  size_t slot;
+  if (aid < 0 || iid < 0 ||
+      !AttributeIndexFind((uint64_t) aid, (uint64_t) iid, &slot)) {
+    mg_rpc_send_errorf(ri, 404, "No characteristic %d.%d", aid, iid);
+    return;
+  }
+  if (!(AttributeIndexGetInfo(slot).properties &
+        kAttributeIndexProperty_SupportsEventNotification)) {
+    mg_rpc_send_errorf(ri, 400, "%d.%d does not support events", aid, iid);
+    return;
+  }
+  AttributeIndexEntry e;
+  AttributeIndexGet(slot, &e);
+  AccessoryNotification(e.accessory, e.service, e.characteristic, NULL);
+  mg_rpc_send_responsef(ri, NULL);
+}
+
+/**
+ * Upper bound of reads per configuration of one App.ReadBench run, which
+ * blocks the main loop while it runs.
+ */
+#define kAppMaxReadBenchReads 100000
+
+/**
+ * Upper bound of reads of the log configuration of one App.ReadBench run:
+ * each of them writes a line to the device log.
+ */
+#define kAppMaxReadBenchLogLines 100
+
+/**
+ * Per-access instrumentation of a read, as compared by App.ReadBench.
+ */
+typedef enum {
+  kReadBench_None,   // Nothing.
+  kReadBench_Trace,  // A trace event, what the read handler records now.
+  kReadBench_Log,    // The log line the read handler used to write.
+  kReadBench_Count
+} ReadBenchConfig;
+
+/**
+ * Sink for the benchmark results, so that the compiler keeps the work.
+ */
+static volatile uint32_t readBenchSink;
+
+/**
+ * Time numReads reads of the On characteristic of the first light.
+ *
+ * @return Microseconds taken.
+ */
+static int64_t TimeReads(ReadBenchConfig config, int numReads) {
+  const HAPAccessory *a = LightAccessory(0);
+  uint32_t sum = 0;
+  int64_t startUs = mgos_uptime_micros();
+  for (int i = 0; i < numReads; i++) {
+    bool value = ReadLightOn(a, &lightBulbOnCharacteristic, 0);
+    switch (config) {
+      case kReadBench_Trace:
+        TRACE(kTraceEvent_LightBulbOnRead, value);
+        break;
+      case kReadBench_Log:
+        HAPLogInfo(&kHAPLog_Default, "%s: %s", "HandleLightBulbOnRead",
+                   value ? "true" : "false");
+        break;
+      default:
+        break;
+    }
+    sum += value;
+  }
+  int64_t us = mgos_uptime_micros() - startUs;
+  readBenchSink = sum;
+  return us;
+}
+
+/**
+ * App.ReadBench RPC: time the read of the On characteristic (value cache,
+ * state on a miss) with each kind of per-access instrumentation. Reports
+ * nanoseconds and CPU cycles per read. The trace and log runs write to the
+ * trace buffer and the log; the trace run costs the same as none when
+ * tracing is compiled out (APP_TRACE=0). The log run is capped at
+ * kAppMaxReadBenchLogLines reads.
+ */
+static void AppReadBenchRPCHandler(struct mg_rpc_request_info *ri,
+                                   void *cb_arg HAP_UNUSED,
+                                   struct mg_rpc_frame_info *fi HAP_UNUSED,
+                                   struct mg_str args) {
+  int numReads = 100;
+  json_scanf(args.p, args.len, ri->args_fmt, &numReads);
+  if (numReads < 1 || numReads > kAppMaxReadBenchReads) {
+    mg_rpc_send_errorf(ri, 400, "Need 1 <= reads <= %d",
+                       kAppMaxReadBenchReads);
+    return;
+  }
+  int numLogReads =
+      (numReads < kAppMaxReadBenchLogLines ? numReads
+                                           : kAppMaxReadBenchLogLines);
+  double nsPerRead[kReadBench_Count];
+  for (int config = 0; config < kReadBench_Count; config++) {
+    int n = (config == kReadBench_Log ? numLogReads : numReads);
+    nsPerRead[config] = TimeReads((ReadBenchConfig) config, n) * 1000.0 / n;
+  }
+  double cyclesPerNs = mgos_get_cpu_freq() / 1e9;
+  mg_rpc_send_responsef(
+      ri,
+      "{reads: %d, trace_enabled: %B, cpu_freq: %u, "
+      "none: {ns: %.1lf, cycles: %.0lf}, trace: {ns: %.1lf, cycles: %.0lf}, "
+      "log: {reads: %d, ns: %.1lf, cycles: %.0lf}}",
+      numReads, (bool) APP_TRACE, (unsigned) mgos_get_cpu_freq(),
+      nsPerRead[kReadBench_None], nsPerRead[kReadBench_None] * cyclesPerNs,
+      nsPerRead[kReadBench_Trace], nsPerRead[kReadBench_Trace] * cyclesPerNs,
+      numLogReads, nsPerRead[kReadBench_Log],
+      nsPerRead[kReadBench_Log] * cyclesPerNs);
+}
+
+/**
+ * Read the names of the bridged lights from a JSON table of the form
+ * {"lights": [{"name": "Kitchen"}, {"name": "Hall"}]}.
+ *
+ * @return Array of names, or NULL if the table is missing or empty.
+ */
+static char **LoadBridgeTable(const char *fileName, size_t *numLights) {
+  char *json = json_fread(fileName);
+  if (json == NULL) {
+    HAPLogError(&kHAPLog_Default, "%s: cannot read %s", __func__, fileName);
+    return NULL;
+  }
+  int len = (int) strlen(json);
+  struct json_token t;
+  size_t n = 0;
+  while (n < kAppMaxBridgedLights &&
+         json_scanf_array_elem(json, len, ".lights", (int) n, &t) > 0) {
+    n++;
+  }
+  char **names = (n > 0 ? calloc(n, sizeof *names) : NULL);
+  for (size_t i = 0; names != NULL && i < n; i++) {
+    json_scanf_array_elem(json, len, ".lights", (int) i, &t);
+    json_scanf(t.ptr, t.len, "{name: %Q}", &names[i]);
+    if (names[i] == NULL && (names[i] = malloc(12)) != NULL) {
+      snprintf(names[i], 12, "Light %u", (unsigned) (i + 1));
+    }
+  }
+  free(json);
+  *numLights = n;
+  return names;
+}
+
+/**
+ * Build the light table, in bridge mode from app.bridge_table.
+ */
+static void InitializeLightTable(void) {
+  const char *tableFileName = mgos_sys_config_get_app_bridge_table();
+  size_t numLights = 0;
+  char **names = NULL;
+  if (tableFileName != NULL && tableFileName[0] != '\0') {
+    names = LoadBridgeTable(tableFileName, &numLights);
+    if (names == NULL) {
+      HAPLogError(&kHAPLog_Default, "No bridged lights, using a single light.");
+    }
+  }
+
+  size_t freeHeapBefore = mgos_get_free_heap_size();
+  lightTable.isBridge = (names != NULL);
+  lightTable.numLights = (lightTable.isBridge ? numLights : 1);
+  lightTable.state = calloc(1, AccessoryStateNumBytes());
+  lightTable.actuators =
+      calloc(lightTable.numLights, sizeof *lightTable.actuators);
+  HAPAssert(lightTable.state && lightTable.actuators);
+  int channelsPerLight = mgos_sys_config_get_app_output_channels_per_light();
+  if (channelsPerLight != 1 && channelsPerLight != 3 &&
+      channelsPerLight != kColorChannel_Count) {
+    LOG(LL_ERROR, ("Unsupported app.output.channels_per_light %d, using 1",
+                   channelsPerLight));
+    channelsPerLight = 1;
+  }
+  lightTable.channelsPerLight = (size_t) channelsPerLight;
+  if (!lightTable.isBridge) {
+    return;
+  }
+
+  lightTable.lights = calloc(numLights, sizeof *lightTable.lights);
+  lightTable.bridgedAccessories =
+      calloc(numLights + 1, sizeof *lightTable.bridgedAccessories);
+  HAPAssert(lightTable.lights && lightTable.bridgedAccessories);
+  for (size_t i = 0; i < numLights; i++) {
+    HAPAccessory *a = &lightTable.lights[i].accessory;
+    HAPAssert(names[i]);
+    a->aid = kAppFirstBridgedLightAID + i;
+    a->category = kHAPAccessoryCategory_BridgedAccessory;
+    a->name = names[i];
+    a->manufacturer = accessory.manufacturer;
+    a->model = accessory.model;
+    a->serialNumber = accessory.serialNumber;
+    a->firmwareVersion = accessory.firmwareVersion;
+    a->hardwareVersion = accessory.hardwareVersion;
+    a->services = bridgedLightServices;
+    a->callbacks.identify = IdentifyAccessory;
+    lightTable.bridgedAccessories[i] = a;
+  }
+  free(names);  // The names themselves are owned by the accessories now.
+
+  accessory.category = kHAPAccessoryCategory_Bridges;
+  accessory.services = bridgeAccessoryServices;
+
+  size_t perLightBytes = sizeof(AppLight) +
+                         sizeof *lightTable.bridgedAccessories +
+                         sizeof *lightTable.state->lights +
+                         sizeof *lightTable.actuators;
+  LOG(LL_INFO, ("Bridge: %u lights, %u bytes per light + name, %u bytes of "
+                "heap used, %u attributes",
+                (unsigned) numLights, (unsigned) perLightBytes,
+                (unsigned) (freeHeapBefore - mgos_get_free_heap_size()),
+                (unsigned) AppGetAttributeCount()));
+}
+
 void AppInitialize(
     HAPAccessoryServerOptions *hapAccessoryServerOptions HAP_UNUSED,
     HAPPlatform *hapPlatform HAP_UNUSED,
     HAPAccessoryServerCallbacks *hapAccessoryServerCallbacks HAP_UNUSED) {
   accessory.firmwareVersion = mgos_sys_ro_vars_get_fw_version();
   accessory.serialNumber = mgos_sys_config_get_device_sn();
-  lightBulbService.name = mgos_sys_config_get_lightbulb_name();
+  InitializeLightTable();
+  ColorInit((uint32_t) mgos_sys_config_get_app_output_gamma());
+  TransitionInit(lightTable.numLights * lightTable.channelsPerLight);
+  ButtonInit(HandleButtonPress);
+  AttributeIndexInit();
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, AppRebootHandler, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.Notify", "{aid: %d, iid: %d}",
+                     AppNotifyRPCHandler, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.ReadBench", "{reads: %d}",
+                     AppReadBenchRPCHandler, NULL);
 }
 
 void AppDeinitialize() {
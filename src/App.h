@@ -19,6 +19,8 @@ extern "C" {
 
 #include "HAP.h"
 
+#include "LogKVStore.h"
+
 #if __has_feature(nullability)
 #pragma clang assume_nonnull begin
 #endif
@@ -31,6 +33,15 @@ HAPError IdentifyAccessory(HAPAccessoryServerRef *server,
                            const HAPAccessoryIdentifyRequest *request,
                            void *_Nullable context);
 
+/**
+ * Handle read request to the 'Name' characteristic of the Light Bulb service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbNameRead(
+    HAPAccessoryServerRef *server,
+    const HAPStringCharacteristicReadRequest *request, char *value,
+    size_t maxValueBytes, void *_Nullable context);
+
 /**
  * Handle read request to the 'On' characteristic of the Light Bulb service.
  */
@@ -48,17 +59,104 @@ HAPError HandleLightBulbOnWrite(
     const HAPBoolCharacteristicWriteRequest *request, bool value,
     void *_Nullable context);
 
+/**
+ * Handle read request to the 'Brightness' characteristic of the Light Bulb
+ * service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbBrightnessRead(
+    HAPAccessoryServerRef *server,
+    const HAPIntCharacteristicReadRequest *request, int32_t *value,
+    void *_Nullable context);
+
+/**
+ * Handle write request to the 'Brightness' characteristic of the Light Bulb
+ * service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbBrightnessWrite(
+    HAPAccessoryServerRef *server,
+    const HAPIntCharacteristicWriteRequest *request, int32_t value,
+    void *_Nullable context);
+
+/**
+ * Handle read request to the 'Hue' characteristic of the Light Bulb service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbHueRead(
+    HAPAccessoryServerRef *server,
+    const HAPFloatCharacteristicReadRequest *request, float *value,
+    void *_Nullable context);
+
+/**
+ * Handle write request to the 'Hue' characteristic of the Light Bulb service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbHueWrite(
+    HAPAccessoryServerRef *server,
+    const HAPFloatCharacteristicWriteRequest *request, float value,
+    void *_Nullable context);
+
+/**
+ * Handle read request to the 'Saturation' characteristic of the Light Bulb
+ * service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbSaturationRead(
+    HAPAccessoryServerRef *server,
+    const HAPFloatCharacteristicReadRequest *request, float *value,
+    void *_Nullable context);
+
+/**
+ * Handle write request to the 'Saturation' characteristic of the Light Bulb
+ * service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbSaturationWrite(
+    HAPAccessoryServerRef *server,
+    const HAPFloatCharacteristicWriteRequest *request, float value,
+    void *_Nullable context);
+
+/**
+ * Handle read request to the 'Color Temperature' characteristic of the Light
+ * Bulb service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbColorTemperatureRead(
+    HAPAccessoryServerRef *server,
+    const HAPUInt32CharacteristicReadRequest *request, uint32_t *value,
+    void *_Nullable context);
+
+/**
+ * Handle write request to the 'Color Temperature' characteristic of the Light
+ * Bulb service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleLightBulbColorTemperatureWrite(
+    HAPAccessoryServerRef *server,
+    const HAPUInt32CharacteristicWriteRequest *request, uint32_t value,
+    void *_Nullable context);
+
 /**
  * Initialize the application.
+ *
+ * If stateLog is provided, the app state is kept there instead of in the
+ * platform key-value store.
  */
 void AppCreate(HAPAccessoryServerRef *server,
-               HAPPlatformKeyValueStoreRef keyValueStore);
+               HAPPlatformKeyValueStoreRef keyValueStore,
+               LogKVStoreRef _Nullable stateLog);
 
 /**
  * Deinitialize the application.
  */
 void AppRelease(void);
 
+/**
+ * Write out pending accessory state changes immediately.
+ */
+void AppFlushAccessoryState(void);
+
 /**
  * Start the accessory server for the app.
  */
@@ -88,6 +186,12 @@ void RestorePlatformFactorySettings(void);
  */
 HAPAccessory *AppGetAccessoryInfo();
 
+/**
+ * Returns the number of services and characteristics of the top-level
+ * accessory and all bridged accessories.
+ */
+size_t AppGetAttributeCount(void);
+
 #if __has_feature(nullability)
 #pragma clang assume_nonnull end
 #endif
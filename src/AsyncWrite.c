@@ -0,0 +1,116 @@
+// Deferred completion of writes to slow actuators.
+
+#include "AsyncWrite.h"
+
+#include "mgos.h"
+
+typedef struct {
+  AsyncWriteID id;  // 0: free.
+  mgos_timer_id timer;
+  int64_t startedUs;
+  AsyncWriteDoneCallback done;
+  void *_Nullable context;
+} PendingWrite;
+
+static struct {
+  PendingWrite pending[kAsyncWrite_MaxPending];
+  size_t numPending;
+  AsyncWriteID nextID;
+  AsyncWriteStats stats;
+} asyncWrites;
+
+static PendingWrite *_Nullable FindWrite(AsyncWriteID id) {
+  for (size_t i = 0; i < kAsyncWrite_MaxPending; i++) {
+    if (asyncWrites.pending[i].id == id) {
+      return &asyncWrites.pending[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Release a write and report its outcome.
+ */
+static void Finish(PendingWrite *w, HAPError status, bool superseded) {
+  PendingWrite done = *w;
+  HAPRawBufferZero(w, sizeof *w);
+  asyncWrites.numPending--;
+
+  uint32_t latencyMs =
+      (uint32_t)((mgos_uptime_micros() - done.startedUs) / 1000);
+  if (latencyMs > asyncWrites.stats.maxLatencyMs) {
+    asyncWrites.stats.maxLatencyMs = latencyMs;
+  }
+  if (status != kHAPError_None && !superseded) {
+    asyncWrites.stats.numFailed++;
+  }
+  done.done(done.id, status, done.context);
+}
+
+static void AsyncWriteTimerCallback(void *arg) {
+  PendingWrite *w = FindWrite((AsyncWriteID)(uintptr_t) arg);
+  if (w == NULL) {
+    return;
+  }
+  w->timer = MGOS_INVALID_TIMER_ID;
+  asyncWrites.stats.numTimedOut++;
+  Finish(w, kHAPError_Busy, false);
+}
+
+AsyncWriteID AsyncWriteStart(uint32_t timeoutMs, AsyncWriteDoneCallback done,
+                             void *_Nullable context) {
+  HAPPrecondition(done);
+
+  PendingWrite *w = FindWrite(0);
+  if (w == NULL) {
+    asyncWrites.stats.numFailed++;
+    return 0;
+  }
+  if (++asyncWrites.nextID == 0) {
+    asyncWrites.nextID = 1;
+  }
+  *w = (PendingWrite){.id = asyncWrites.nextID,
+                      .startedUs = mgos_uptime_micros(),
+                      .done = done,
+                      .context = context};
+  w->timer = mgos_set_timer((int) timeoutMs, 0, AsyncWriteTimerCallback,
+                            (void *) (uintptr_t) w->id);
+  asyncWrites.numPending++;
+  asyncWrites.stats.numStarted++;
+  return w->id;
+}
+
+void AsyncWriteComplete(AsyncWriteID id, HAPError status) {
+  if (id == 0) {
+    return;
+  }
+  PendingWrite *w = FindWrite(id);
+  if (w == NULL) {
+    return;  // Timed out already.
+  }
+  mgos_clear_timer(w->timer);
+  Finish(w, status, false);
+}
+
+void AsyncWriteSupersede(AsyncWriteID id) {
+  if (id == 0) {
+    return;
+  }
+  PendingWrite *w = FindWrite(id);
+  if (w == NULL) {
+    return;  // Timed out already.
+  }
+  mgos_clear_timer(w->timer);
+  asyncWrites.stats.numSuperseded++;
+  Finish(w, kAsyncWriteStatus_Superseded, true);
+}
+
+size_t AsyncWriteGetNumPending(void) {
+  return asyncWrites.numPending;
+}
+
+void AsyncWriteGetStats(AsyncWriteStats *stats) {
+  HAPPrecondition(stats);
+
+  *stats = asyncWrites.stats;
+}
@@ -0,0 +1,99 @@
+// Deferred completion of writes to slow actuators.
+//
+// The accessory server expects write handlers to finish inside the request,
+// so a handler that waits for a UART dimmer or a radio link stalls every
+// session. Instead the app accepts the write right away and starts the
+// actuator; the actuator reports back through AsyncWriteComplete, or the
+// write times out. The done callback then either confirms the new state or
+// rolls it back and notifies the controllers of the real value.
+
+#ifndef ASYNC_WRITE_H
+#define ASYNC_WRITE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Maximum number of writes in flight.
+ */
+#define kAsyncWrite_MaxPending ((size_t) 16)
+
+/**
+ * Identifies a write in flight. 0 is never a valid id.
+ */
+typedef uint32_t AsyncWriteID;
+
+/**
+ * Status of a write that a later write to the same actuator replaced before
+ * it was applied (AsyncWriteSupersede).
+ */
+#define kAsyncWriteStatus_Superseded kHAPError_InvalidState
+
+/**
+ * Called once per write: with kHAPError_None on success, kHAPError_Busy on
+ * timeout, kAsyncWriteStatus_Superseded, or the error reported by the
+ * actuator.
+ */
+typedef void (*AsyncWriteDoneCallback)(AsyncWriteID id, HAPError status,
+                                       void *_Nullable context);
+
+/**
+ * Write counters.
+ */
+typedef struct {
+  uint32_t numStarted;
+  uint32_t numFailed;    // Including timeouts and a full table.
+  uint32_t numTimedOut;
+  uint32_t numSuperseded;  // Not counted as failed.
+  uint32_t maxLatencyMs;
+} AsyncWriteStats;
+
+/**
+ * Start tracking a write.
+ *
+ * @return Id to pass to AsyncWriteComplete, or 0 if too many writes are in
+ *         flight. In that case done is not called.
+ */
+HAP_RESULT_USE_CHECK
+AsyncWriteID AsyncWriteStart(uint32_t timeoutMs, AsyncWriteDoneCallback done,
+                             void *_Nullable context);
+
+/**
+ * Report the outcome of a write. Ignored if the write has already timed out.
+ * Must be called from the main loop.
+ */
+void AsyncWriteComplete(AsyncWriteID id, HAPError status);
+
+/**
+ * Report that a write will not be applied because a later one replaced it.
+ * The write completes with kAsyncWriteStatus_Superseded. Ignored if the write
+ * has already timed out. Must be called from the main loop.
+ */
+void AsyncWriteSupersede(AsyncWriteID id);
+
+/**
+ * Number of writes in flight.
+ */
+size_t AsyncWriteGetNumPending(void);
+
+/**
+ * Get write counters.
+ */
+void AsyncWriteGetStats(AsyncWriteStats *stats);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,359 @@
+// Attribute index.
+
+#include "AttributeIndex.h"
+
+#include "HAP+Internal.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+/**
+ * Largest aid and iid that fit into a packed key.
+ */
+#define kAttributeIndex_MaxID ((uint64_t) UINT16_MAX)
+
+/**
+ * Upper bound of lookups of one App.IndexBench run, which blocks the main
+ * loop while it runs.
+ */
+#define kAttributeIndex_MaxBenchLookups 1000000
+
+typedef struct {
+  const HAPService *service;
+  const HAPCharacteristic *characteristic;
+} IndexRef;
+
+typedef struct {
+  uint32_t key;  // aid << 16 | iid.
+  IndexRef ref;
+  AttributeIndexInfo info;
+} IndexEntry;
+
+/**
+ * The keys are kept apart from what they map to, so the bisection only touches
+ * a dense uint32_t array. The accessory is found from the aid in the key.
+ */
+static struct {
+  uint32_t *_Nullable keys;  // Sorted.
+  AttributeIndexInfo *_Nullable infos;  // In key order.
+  IndexRef *_Nullable refs;  // In key order.
+  size_t numEntries;
+  const HAPAccessory **_Nullable accessories;  // Sorted by aid.
+  size_t numAccessories;
+} attributeIndex;
+
+static uint32_t PackKey(uint64_t aid, uint64_t iid) {
+  return (uint32_t)(aid << 16 | iid);
+}
+
+static uint64_t CharacteristicIID(const HAPCharacteristic *characteristic) {
+  return ((const HAPBaseCharacteristic *) characteristic)->iid;
+}
+
+static AttributeIndexInfo CharacteristicInfo(
+    const HAPCharacteristic *characteristic) {
+  const HAPBaseCharacteristic *c =
+      (const HAPBaseCharacteristic *) characteristic;
+  uint8_t properties = 0;
+  if (c->properties.readable) {
+    properties |= kAttributeIndexProperty_Readable;
+  }
+  if (c->properties.writable) {
+    properties |= kAttributeIndexProperty_Writable;
+  }
+  if (c->properties.supportsEventNotification) {
+    properties |= kAttributeIndexProperty_SupportsEventNotification;
+  }
+  if (c->properties.hidden) {
+    properties |= kAttributeIndexProperty_Hidden;
+  }
+  if (c->properties.requiresTimedWrite) {
+    properties |= kAttributeIndexProperty_RequiresTimedWrite;
+  }
+  return (AttributeIndexInfo){.format = (uint8_t) c->format,
+                              .properties = properties};
+}
+
+static int CompareEntries(const void *a, const void *b) {
+  uint32_t ka = ((const IndexEntry *) a)->key;
+  uint32_t kb = ((const IndexEntry *) b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+static int CompareAccessories(const void *a, const void *b) {
+  uint64_t aa = (*(const HAPAccessory *const *) a)->aid;
+  uint64_t ab = (*(const HAPAccessory *const *) b)->aid;
+  return (aa > ab) - (aa < ab);
+}
+
+/**
+ * Add the characteristics of an accessory, or only count them if entries is
+ * NULL.
+ */
+static size_t AddAccessory(const HAPAccessory *accessory,
+                           IndexEntry *_Nullable entries) {
+  HAPPrecondition(accessory->aid <= kAttributeIndex_MaxID);
+  size_t n = 0;
+  for (const HAPService *const *s = accessory->services; *s != NULL; s++) {
+    for (const HAPCharacteristic *const *c = (*s)->characteristics;
+         *c != NULL; c++, n++) {
+      if (entries == NULL) continue;
+      uint64_t iid = CharacteristicIID(*c);
+      HAPPrecondition(iid <= kAttributeIndex_MaxID);
+      entries[n] = (IndexEntry){
+          .key = PackKey(accessory->aid, iid),
+          .ref = {.service = *s, .characteristic = *c},
+          .info = CharacteristicInfo(*c)};
+    }
+  }
+  return n;
+}
+
+void AttributeIndexBuild(
+    const HAPAccessory *accessory,
+    const HAPAccessory *_Nullable const *_Nullable bridgedAccessories) {
+  HAPPrecondition(accessory);
+
+  AttributeIndexRelease();
+
+  size_t numAccessories = 1;
+  while (bridgedAccessories && bridgedAccessories[numAccessories - 1]) {
+    numAccessories++;
+  }
+  attributeIndex.accessories =
+      calloc(numAccessories, sizeof *attributeIndex.accessories);
+  HAPAssert(attributeIndex.accessories);
+  size_t numEntries = 0;
+  for (size_t i = 0; i < numAccessories; i++) {
+    const HAPAccessory *a = (i == 0 ? accessory : bridgedAccessories[i - 1]);
+    attributeIndex.accessories[i] = a;
+    numEntries += AddAccessory(a, NULL);
+  }
+  attributeIndex.numAccessories = numAccessories;
+
+  IndexEntry *entries = calloc(numEntries, sizeof *entries);
+  HAPAssert(entries);
+  size_t n = 0;
+  for (size_t i = 0; i < numAccessories; i++) {
+    n += AddAccessory(attributeIndex.accessories[i], &entries[n]);
+  }
+  qsort(entries, numEntries, sizeof *entries, CompareEntries);
+  qsort(attributeIndex.accessories, numAccessories,
+        sizeof *attributeIndex.accessories, CompareAccessories);
+
+  attributeIndex.keys = calloc(numEntries, sizeof *attributeIndex.keys);
+  attributeIndex.infos = calloc(numEntries, sizeof *attributeIndex.infos);
+  attributeIndex.refs = calloc(numEntries, sizeof *attributeIndex.refs);
+  HAPAssert(attributeIndex.keys && attributeIndex.infos && attributeIndex.refs);
+  for (size_t i = 0; i < numEntries; i++) {
+    // Duplicate (aid, iid) pairs make the attribute database invalid.
+    HAPPrecondition(i == 0 || entries[i].key != entries[i - 1].key);
+    attributeIndex.keys[i] = entries[i].key;
+    attributeIndex.infos[i] = entries[i].info;
+    attributeIndex.refs[i] = entries[i].ref;
+  }
+  attributeIndex.numEntries = numEntries;
+  free(entries);
+
+  LOG(LL_INFO, ("Attribute index: %u characteristics, %u bytes",
+                (unsigned) numEntries,
+                (unsigned) (numEntries * (sizeof *attributeIndex.keys +
+                                          sizeof *attributeIndex.infos +
+                                          sizeof *attributeIndex.refs) +
+                            numAccessories *
+                                sizeof *attributeIndex.accessories)));
+}
+
+void AttributeIndexRelease(void) {
+  free(attributeIndex.keys);
+  free(attributeIndex.infos);
+  free(attributeIndex.refs);
+  free(attributeIndex.accessories);
+  HAPRawBufferZero(&attributeIndex, sizeof attributeIndex);
+}
+
+size_t AttributeIndexGetCount(void) {
+  return attributeIndex.numEntries;
+}
+
+bool AttributeIndexFind(uint64_t aid, uint64_t iid, size_t *slot) {
+  HAPPrecondition(slot);
+
+  if (aid > kAttributeIndex_MaxID || iid > kAttributeIndex_MaxID) {
+    return false;
+  }
+  uint32_t key = PackKey(aid, iid);
+  // Branch-free bisection: the loop runs log2(n) times whatever the key, and
+  // the comparison compiles to a conditional move.
+  const uint32_t *base = attributeIndex.keys;
+  size_t n = attributeIndex.numEntries;
+  if (n == 0) {
+    return false;
+  }
+  while (n > 1) {
+    size_t half = n / 2;
+    base = (base[half] <= key ? base + half : base);
+    n -= half;
+  }
+  if (*base != key) {
+    return false;
+  }
+  *slot = (size_t)(base - attributeIndex.keys);
+  return true;
+}
+
+bool AttributeIndexFindCharacteristic(const HAPAccessory *accessory,
+                                      const HAPCharacteristic *characteristic,
+                                      size_t *slot) {
+  HAPPrecondition(accessory);
+  HAPPrecondition(characteristic);
+
+  return AttributeIndexFind(accessory->aid, CharacteristicIID(characteristic),
+                            slot);
+}
+
+void AttributeIndexGet(size_t slot, AttributeIndexEntry *entry) {
+  HAPPrecondition(slot < attributeIndex.numEntries);
+  HAPPrecondition(entry);
+
+  uint64_t aid = attributeIndex.keys[slot] >> 16;
+  // Accessory ids are usually consecutive, so try the direct position first.
+  size_t lo = 0, hi = attributeIndex.numAccessories;
+  uint64_t offset = aid - attributeIndex.accessories[0]->aid;
+  if (offset < hi && attributeIndex.accessories[offset]->aid == aid) {
+    lo = (size_t) offset;
+  }
+  while (attributeIndex.accessories[lo]->aid != aid && hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (attributeIndex.accessories[mid]->aid <= aid) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  HAPAssert(attributeIndex.accessories[lo]->aid == aid);
+  entry->accessory = attributeIndex.accessories[lo];
+  entry->service = attributeIndex.refs[slot].service;
+  entry->characteristic = attributeIndex.refs[slot].characteristic;
+}
+
+AttributeIndexInfo AttributeIndexGetInfo(size_t slot) {
+  HAPPrecondition(slot < attributeIndex.numEntries);
+
+  return attributeIndex.infos[slot];
+}
+
+void AttributeIndexSetProperty(size_t slot, AttributeIndexProperty property,
+                               bool set) {
+  HAPPrecondition(slot < attributeIndex.numEntries);
+  HAPPrecondition(property == kAttributeIndexProperty_Volatile);
+
+  if (set) {
+    attributeIndex.infos[slot].properties |= (uint8_t) property;
+  } else {
+    attributeIndex.infos[slot].properties &= (uint8_t) ~property;
+  }
+}
+
+/**
+ * Sink for the benchmark results, so that the compiler keeps the work.
+ */
+static volatile uintptr_t indexBenchSink;
+
+/**
+ * Find a characteristic by walking the attribute database, as the accessory
+ * server does.
+ */
+static const HAPCharacteristic *_Nullable WalkDatabase(uint64_t aid,
+                                                       uint64_t iid) {
+  for (size_t i = 0; i < attributeIndex.numAccessories; i++) {
+    const HAPAccessory *a = attributeIndex.accessories[i];
+    if (a->aid != aid) continue;
+    for (const HAPService *const *s = a->services; *s != NULL; s++) {
+      for (const HAPCharacteristic *const *c = (*s)->characteristics;
+           *c != NULL; c++) {
+        if (CharacteristicIID(*c) == iid) {
+          return *c;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Slot of the i-th lookup of a benchmark run, spread over the whole index.
+ */
+static size_t BenchSlot(uint32_t i) {
+  return (size_t)((i * 2654435761U) % attributeIndex.numEntries);
+}
+
+/**
+ * App.IndexBench RPC: time lookups of characteristics by (aid, iid), spread
+ * over the attribute database, with a walk of the database and with the
+ * index. Then time the property and format check of a request handler for
+ * the same slots, through the characteristic struct and through the hot
+ * record.
+ */
+static void AttributeIndexBenchRPCHandler(
+    struct mg_rpc_request_info *ri, void *cb_arg HAP_UNUSED,
+    struct mg_rpc_frame_info *fi HAP_UNUSED, struct mg_str args) {
+  int numLookups = 10000;
+  json_scanf(args.p, args.len, ri->args_fmt, &numLookups);
+  if (numLookups < 1 || numLookups > kAttributeIndex_MaxBenchLookups) {
+    mg_rpc_send_errorf(ri, 400, "Need 1 <= lookups <= %d",
+                       kAttributeIndex_MaxBenchLookups);
+    return;
+  }
+  if (attributeIndex.numEntries == 0) {
+    mg_rpc_send_errorf(ri, 503, "Accessory server not running");
+    return;
+  }
+  uintptr_t sum = 0;
+  int64_t startUs = mgos_uptime_micros();
+  for (uint32_t i = 0; i < (uint32_t) numLookups; i++) {
+    uint32_t key = attributeIndex.keys[BenchSlot(i)];
+    sum += (uintptr_t) WalkDatabase(key >> 16, key & 0xFFFF);
+  }
+  int64_t walkUs = mgos_uptime_micros() - startUs;
+  startUs = mgos_uptime_micros();
+  for (uint32_t i = 0; i < (uint32_t) numLookups; i++) {
+    uint32_t key = attributeIndex.keys[BenchSlot(i)];
+    size_t slot;
+    if (AttributeIndexFind(key >> 16, key & 0xFFFF, &slot)) {
+      AttributeIndexEntry e;
+      AttributeIndexGet(slot, &e);
+      sum += (uintptr_t) e.characteristic;
+    }
+  }
+  int64_t indexUs = mgos_uptime_micros() - startUs;
+  startUs = mgos_uptime_micros();
+  for (uint32_t i = 0; i < (uint32_t) numLookups; i++) {
+    const HAPBaseCharacteristic *c =
+        (const HAPBaseCharacteristic *) attributeIndex.refs[BenchSlot(i)]
+            .characteristic;
+    sum += c->properties.readable && c->format == kHAPCharacteristicFormat_Bool;
+  }
+  int64_t structUs = mgos_uptime_micros() - startUs;
+  startUs = mgos_uptime_micros();
+  for (uint32_t i = 0; i < (uint32_t) numLookups; i++) {
+    AttributeIndexInfo info = AttributeIndexGetInfo(BenchSlot(i));
+    sum += (info.properties & kAttributeIndexProperty_Readable) &&
+           info.format == kHAPCharacteristicFormat_Bool;
+  }
+  int64_t recordUs = mgos_uptime_micros() - startUs;
+  indexBenchSink = sum;
+  mg_rpc_send_responsef(
+      ri,
+      "{characteristics: %u, accessories: %u, lookups: %d, "
+      "walk_ns: %.1lf, index_ns: %.1lf, struct_ns: %.1lf, record_ns: %.1lf}",
+      (unsigned) attributeIndex.numEntries,
+      (unsigned) attributeIndex.numAccessories, numLookups,
+      walkUs * 1000.0 / numLookups, indexUs * 1000.0 / numLookups,
+      structUs * 1000.0 / numLookups, recordUs * 1000.0 / numLookups);
+}
+
+void AttributeIndexInit(void) {
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.IndexBench",
+                     "{lookups: %d}", AttributeIndexBenchRPCHandler, NULL);
+}
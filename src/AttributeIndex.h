@@ -0,0 +1,127 @@
+// Attribute index.
+//
+// Maps (aid, iid) to the accessory, service and characteristic without
+// walking the attribute database. Built once when the accessory server is
+// started: a sorted array of packed keys, searched by bisection. Each
+// characteristic gets a dense slot number, so per-characteristic state can be
+// kept in plain arrays indexed by slot.
+//
+// What request dispatch needs (format and access properties) is copied into a
+// packed 2-byte record per slot, kept in RAM apart from the HAPCharacteristic
+// structures. The structures live in flash, which the ESP32 reads through a
+// small cache, and mix these fields with cold ones such as descriptions and
+// BLE properties. Every characteristic handler goes through the record of its
+// slot, via the value cache: the format check and whether the value may be
+// served from the cache are one load.
+
+#ifndef ATTRIBUTE_INDEX_H
+#define ATTRIBUTE_INDEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * A characteristic and where it lives.
+ */
+typedef struct {
+  const HAPAccessory *accessory;
+  const HAPService *service;
+  const HAPCharacteristic *characteristic;
+} AttributeIndexEntry;
+
+/**
+ * Access properties of a characteristic.
+ */
+typedef enum {
+  kAttributeIndexProperty_Readable = 1U << 0U,
+  kAttributeIndexProperty_Writable = 1U << 1U,
+  kAttributeIndexProperty_SupportsEventNotification = 1U << 2U,
+  kAttributeIndexProperty_Hidden = 1U << 3U,
+  kAttributeIndexProperty_RequiresTimedWrite = 1U << 4U,
+  kAttributeIndexProperty_Volatile = 1U << 5U,  // See ValueCacheSetVolatile.
+} AttributeIndexProperty;
+
+/**
+ * Hot metadata of a characteristic.
+ */
+typedef struct {
+  uint8_t format;      // HAPCharacteristicFormat.
+  uint8_t properties;  // AttributeIndexProperty bits.
+} AttributeIndexInfo;
+
+/**
+ * Register the App.IndexBench RPC method.
+ */
+void AttributeIndexInit(void);
+
+/**
+ * Build the index over an accessory and its bridged accessories, replacing
+ * any previous index.
+ *
+ * @param  accessory            Top-level accessory.
+ * @param  bridgedAccessories   NULL-terminated array of bridged accessories,
+ *                              or NULL.
+ */
+void AttributeIndexBuild(
+    const HAPAccessory *accessory,
+    const HAPAccessory *_Nullable const *_Nullable bridgedAccessories);
+
+/**
+ * Free the index.
+ */
+void AttributeIndexRelease(void);
+
+/**
+ * Number of indexed characteristics. Slots are 0 to count - 1.
+ */
+size_t AttributeIndexGetCount(void);
+
+/**
+ * Find the slot of a characteristic.
+ *
+ * @return true if found, false otherwise.
+ */
+HAP_RESULT_USE_CHECK
+bool AttributeIndexFind(uint64_t aid, uint64_t iid, size_t *slot);
+
+/**
+ * Find the slot of a characteristic of an accessory.
+ */
+HAP_RESULT_USE_CHECK
+bool AttributeIndexFindCharacteristic(const HAPAccessory *accessory,
+                                      const HAPCharacteristic *characteristic,
+                                      size_t *slot);
+
+/**
+ * Get the characteristic in a slot.
+ */
+void AttributeIndexGet(size_t slot, AttributeIndexEntry *entry);
+
+/**
+ * Get the hot metadata of the characteristic in a slot.
+ */
+AttributeIndexInfo AttributeIndexGetInfo(size_t slot);
+
+/**
+ * Set or clear a property of the characteristic in a slot. Only for the
+ * properties the app owns (kAttributeIndexProperty_Volatile).
+ */
+void AttributeIndexSetProperty(size_t slot, AttributeIndexProperty property,
+                               bool set);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
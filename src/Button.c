@@ -0,0 +1,225 @@
+// Physical button.
+
+#include "Button.h"
+#include "SPSCQueue.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#ifndef APP_BUTTON_HW
+#define APP_BUTTON_HW 0
+#endif
+
+#if APP_BUTTON_HW
+#include "mgos_gpio.h"
+#endif
+
+/**
+ * Number of edges the queue holds. Must be a power of 2.
+ */
+#define kButton_QueueSize ((size_t) 16)
+
+typedef struct {
+  int64_t timeUs;
+  bool pressed;
+} ButtonEdge;
+
+static struct {
+  ButtonPressCallback callback;
+  int pin;  // < 0: virtual button.
+  bool virtualPressed;
+
+  // Interrupt side.
+  SPSCQueue queue;
+  ButtonEdge edges[kButton_QueueSize];
+  int64_t debounceUs;
+  int64_t lastEdgeUs;
+  bool lastPressed;
+  volatile bool drainScheduled;
+  volatile bool resampleScheduled;
+
+  // Main loop side.
+  int64_t pressedUs;
+  bool singlePending;
+  mgos_timer_id singleTimer;
+} button;
+
+static void ButtonDrainCallback(void *arg HAP_UNUSED);
+static void ButtonResampleCallback(void *arg HAP_UNUSED);
+
+/**
+ * Debounce an edge and queue it. Runs in the interrupt handler, so it only
+ * touches the button state and the queue.
+ *
+ * An edge within the debounce interval is dropped, but the pin is sampled
+ * again once the interval is over: the last edge of a bounce, e.g. the
+ * release of a short tap, raises no further interrupt. An edge that does not
+ * fit into the queue is retried the same way.
+ */
+static IRAM void ButtonEdgeDetected(bool pressed, int64_t nowUs,
+                                    bool fromISR) {
+  if (pressed == button.lastPressed) {
+    return;
+  }
+  ButtonEdge edge = {.timeUs = nowUs, .pressed = pressed};
+  if (nowUs - button.lastEdgeUs < button.debounceUs ||
+      !SPSCQueuePush(&button.queue, &edge)) {
+    if (!button.resampleScheduled) {
+      button.resampleScheduled = true;
+      mgos_invoke_cb(ButtonResampleCallback, NULL, fromISR);
+    }
+    return;
+  }
+  button.lastEdgeUs = nowUs;
+  button.lastPressed = pressed;
+  if (!button.drainScheduled) {
+    button.drainScheduled = true;
+    mgos_invoke_cb(ButtonDrainCallback, NULL, fromISR);
+  }
+}
+
+#if APP_BUTTON_HW
+static bool buttonActiveLow;
+
+static IRAM void ButtonInterruptHandler(int pin, void *arg HAP_UNUSED) {
+  ButtonEdgeDetected(mgos_gpio_read(pin) != buttonActiveLow,
+                     mgos_uptime_micros(), true);
+}
+#endif
+
+/**
+ * Current level of the button.
+ */
+static bool ButtonIsPressed(void) {
+#if APP_BUTTON_HW
+  if (button.pin >= 0) {
+    return mgos_gpio_read(button.pin) != buttonActiveLow;
+  }
+#endif
+  return button.virtualPressed;
+}
+
+static void ButtonResampleTimerCallback(void *arg HAP_UNUSED) {
+  button.resampleScheduled = false;
+#if APP_BUTTON_HW
+  // The interrupt handler is the producer of the queue; keep it out while
+  // the main loop pushes.
+  if (button.pin >= 0) {
+    mgos_gpio_disable_int(button.pin);
+  }
+#endif
+  ButtonEdgeDetected(ButtonIsPressed(), mgos_uptime_micros(), false);
+#if APP_BUTTON_HW
+  if (button.pin >= 0) {
+    mgos_gpio_enable_int(button.pin);
+  }
+#endif
+}
+
+/**
+ * Sample the pin again once the debounce interval is over.
+ */
+static void ButtonResampleCallback(void *arg HAP_UNUSED) {
+  int64_t waitUs =
+      button.lastEdgeUs + button.debounceUs - mgos_uptime_micros();
+  int waitMs = (waitUs > 0 ? (int) (waitUs / 1000) : 0) + 1;
+  mgos_set_timer(waitMs, 0, ButtonResampleTimerCallback, NULL);
+}
+
+static void SinglePressTimerCallback(void *arg HAP_UNUSED) {
+  button.singleTimer = MGOS_INVALID_TIMER_ID;
+  button.singlePending = false;
+  button.callback(kButtonPress_Single, mgos_uptime_micros());
+}
+
+/**
+ * Classify a release.
+ */
+static void ButtonReleased(int64_t releasedUs) {
+  int64_t heldMs = (releasedUs - button.pressedUs) / 1000;
+  if (heldMs >= mgos_sys_config_get_app_button_long_ms()) {
+    button.callback(kButtonPress_Long, releasedUs);
+    return;
+  }
+  if (button.singlePending) {
+    mgos_clear_timer(button.singleTimer);
+    button.singleTimer = MGOS_INVALID_TIMER_ID;
+    button.singlePending = false;
+    button.callback(kButtonPress_Double, releasedUs);
+    return;
+  }
+  int doubleMs = mgos_sys_config_get_app_button_double_ms();
+  if (doubleMs <= 0) {
+    button.callback(kButtonPress_Single, releasedUs);
+    return;
+  }
+  // Wait to see whether a second press follows.
+  button.singlePending = true;
+  button.singleTimer =
+      mgos_set_timer(doubleMs, 0, SinglePressTimerCallback, NULL);
+}
+
+static void ButtonDrainCallback(void *arg HAP_UNUSED) {
+  button.drainScheduled = false;
+  ButtonEdge edge;
+  while (SPSCQueuePop(&button.queue, &edge)) {
+    if (edge.pressed) {
+      button.pressedUs = edge.timeUs;
+    } else {
+      ButtonReleased(edge.timeUs);
+    }
+  }
+}
+
+static void VirtualReleaseTimerCallback(void *arg HAP_UNUSED) {
+  button.virtualPressed = false;
+  ButtonEdgeDetected(false, mgos_uptime_micros(), false);
+}
+
+/**
+ * App.Button RPC: press the virtual button for hold_ms (default 50).
+ */
+static void ButtonRPCHandler(struct mg_rpc_request_info *ri,
+                             void *cb_arg HAP_UNUSED,
+                             struct mg_rpc_frame_info *fi HAP_UNUSED,
+                             struct mg_str args) {
+  if (button.pin >= 0) {
+    mg_rpc_send_errorf(ri, 400, "Not available with a button on pin %d",
+                       button.pin);
+    return;
+  }
+  int holdMs = 50;
+  json_scanf(args.p, args.len, ri->args_fmt, &holdMs);
+  button.virtualPressed = true;
+  ButtonEdgeDetected(true, mgos_uptime_micros(), false);
+  mgos_set_timer(holdMs > 0 ? holdMs : 0, 0, VirtualReleaseTimerCallback,
+                 NULL);
+  mg_rpc_send_responsef(ri, NULL);
+}
+
+void ButtonInit(ButtonPressCallback callback) {
+  HAPPrecondition(callback);
+
+  button.callback = callback;
+  button.pin = mgos_sys_config_get_app_button_pin();
+  button.debounceUs =
+      (int64_t) mgos_sys_config_get_app_button_debounce_ms() * 1000;
+  button.lastEdgeUs = INT64_MIN / 2;
+  SPSCQueueInit(&button.queue, button.edges, sizeof button.edges[0],
+                kButton_QueueSize);
+#if APP_BUTTON_HW
+  if (button.pin >= 0) {
+    buttonActiveLow = mgos_sys_config_get_app_button_active_low();
+    mgos_gpio_setup_input(button.pin, buttonActiveLow ? MGOS_GPIO_PULL_UP
+                                                      : MGOS_GPIO_PULL_DOWN);
+    mgos_gpio_set_int_handler_isr(button.pin, MGOS_GPIO_INT_EDGE_ANY,
+                                  ButtonInterruptHandler, NULL);
+    mgos_gpio_enable_int(button.pin);
+    LOG(LL_INFO, ("Button on pin %d", button.pin));
+  }
+#else
+  button.pin = -1;
+#endif
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.Button", "{hold_ms: %d}",
+                     ButtonRPCHandler, NULL);
+}
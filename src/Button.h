@@ -0,0 +1,56 @@
+// Physical button.
+//
+// The interrupt handler debounces the button pin and pushes each accepted
+// edge, with its timestamp, onto a lock-free queue. The main loop turns the
+// edges into presses: a single press, a double press (second press within
+// app.button.double_ms) or a long press (held for app.button.long_ms), and
+// hands them to the app, which changes the light and notifies controllers.
+//
+// Without a button pin (app.button.pin < 0, always the case on the host
+// build), the App.Button RPC method injects edges into the same queue as a
+// virtual button.
+
+#ifndef BUTTON_H
+#define BUTTON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Kinds of press.
+ */
+typedef enum {
+  kButtonPress_Single = 1,
+  kButtonPress_Double,
+  kButtonPress_Long,
+} ButtonPress;
+
+/**
+ * Called from the main loop for each press. edgeUs is the time of the edge
+ * that completed the press, from mgos_uptime_micros, or for a single press
+ * the time the double press window closed, so that edgeUs to now excludes
+ * the deliberate wait.
+ */
+typedef void (*ButtonPressCallback)(ButtonPress press, int64_t edgeUs);
+
+/**
+ * Set up the button from app.button and register the App.Button RPC method.
+ */
+void ButtonInit(ButtonPressCallback callback);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,148 @@
+// Color conversion for the light outputs.
+
+#include "Color.h"
+
+#include <math.h>
+
+/**
+ * Spacing of the color temperature table, mireds.
+ */
+#define kColor_MiredsStep ((uint32_t) 10)
+
+#define kColor_NumTemperatures \
+  ((size_t)((kColor_MaxMireds - kColor_MinMireds) / kColor_MiredsStep + 1))
+
+static uint16_t gammaTable[257];
+static uint16_t hueTable[kColor_NumHueSteps + 1][3];
+static uint16_t temperatureTable[kColor_NumTemperatures][kColorChannel_Count];
+
+/**
+ * a * b / 0xFFFF, rounded.
+ */
+static uint16_t Scale(uint16_t a, uint16_t b) {
+  return (uint16_t)(((uint32_t) a * b + 0x7FFF) / 0xFFFF);
+}
+
+/**
+ * Interpolate between a and b, f in 1/256.
+ */
+static uint16_t Lerp(uint16_t a, uint16_t b, uint32_t f) {
+  return (uint16_t)(a + ((int32_t) b - a) * (int32_t) f / 256);
+}
+
+static uint16_t Level(float x) {
+  if (x <= 0.0f) return 0;
+  if (x >= 1.0f) return 0xFFFF;
+  return (uint16_t) lroundf(x * 0xFFFF);
+}
+
+static void InitGammaTable(uint32_t gammaX100) {
+  float gamma = (gammaX100 > 0 ? gammaX100 / 100.0f : 1.0f);
+  for (size_t i = 0; i < HAPArrayCount(gammaTable); i++) {
+    gammaTable[i] = Level(powf(i / 256.0f, gamma));
+  }
+}
+
+/**
+ * Between two corners of the HSV hexagon one channel is full, one is off and
+ * one ramps up or down.
+ */
+enum { kRamp_Full, kRamp_Off, kRamp_Up, kRamp_Down };
+
+static const uint8_t hueSectors[6][3] = {
+    {kRamp_Full, kRamp_Up, kRamp_Off},   {kRamp_Down, kRamp_Full, kRamp_Off},
+    {kRamp_Off, kRamp_Full, kRamp_Up},   {kRamp_Off, kRamp_Down, kRamp_Full},
+    {kRamp_Up, kRamp_Off, kRamp_Full},   {kRamp_Full, kRamp_Off, kRamp_Down}};
+
+static void InitHueTable(void) {
+  const size_t stepsPerSector = kColor_NumHueSteps / 6;
+  for (size_t i = 0; i <= kColor_NumHueSteps; i++) {
+    uint16_t up = (uint16_t)((i % stepsPerSector) * 0xFFFF / stepsPerSector);
+    const uint16_t ramps[] = {
+        [kRamp_Full] = 0xFFFF, [kRamp_Off] = 0, [kRamp_Up] = up,
+        [kRamp_Down] = (uint16_t)(0xFFFF - up)};
+    const uint8_t *sector = hueSectors[(i / stepsPerSector) % 6];
+    for (size_t k = 0; k < 3; k++) {
+      hueTable[i][k] = ramps[sector[k]];
+    }
+  }
+}
+
+/**
+ * Black body color in the usual curve fit (Tanner Helland), normalized to a
+ * brightest channel of 1. The white channel takes the common part.
+ */
+static void InitTemperatureTable(void) {
+  for (size_t i = 0; i < kColor_NumTemperatures; i++) {
+    float t = 1e4f / (kColor_MinMireds + i * kColor_MiredsStep);  // K / 100.
+    float r, g, b;
+    if (t <= 66.0f) {
+      r = 255.0f;
+      g = 99.4708025861f * logf(t) - 161.1195681661f;
+      b = (t <= 19.0f ? 0.0f : 138.5177312231f * logf(t - 10.0f) -
+                                   305.0447927307f);
+    } else {
+      r = 329.698727446f * powf(t - 60.0f, -0.1332047592f);
+      g = 288.1221695283f * powf(t - 60.0f, -0.0755148492f);
+      b = 255.0f;
+    }
+    r = fminf(fmaxf(r, 0.0f), 255.0f);
+    g = fminf(fmaxf(g, 0.0f), 255.0f);
+    b = fminf(fmaxf(b, 0.0f), 255.0f);
+    float max = fmaxf(r, fmaxf(g, b));
+    float w = fminf(r, fminf(g, b));
+    uint16_t *rgbw = temperatureTable[i];
+    rgbw[kColorChannel_Red] = Level((r - w) / max);
+    rgbw[kColorChannel_Green] = Level((g - w) / max);
+    rgbw[kColorChannel_Blue] = Level((b - w) / max);
+    rgbw[kColorChannel_White] = Level(w / max);
+  }
+}
+
+void ColorInit(uint32_t gammaX100) {
+  InitGammaTable(gammaX100);
+  InitHueTable();
+  InitTemperatureTable();
+}
+
+uint16_t ColorGamma(uint16_t level) {
+  if (level == 0xFFFF) {
+    return gammaTable[256];
+  }
+  size_t i = level >> 8;
+  return Lerp(gammaTable[i], gammaTable[i + 1], level & 0xFF);
+}
+
+void ColorHSVToRGBW(uint32_t hue, uint32_t saturation, uint16_t level,
+                    uint16_t rgbw[kColorChannel_Count]) {
+  HAPPrecondition(rgbw);
+
+  if (hue > 360) hue = 360;
+  if (saturation > 100) saturation = 100;
+  uint32_t pos = hue * (kColor_NumHueSteps << 8) / 360;
+  size_t i = pos >> 8;
+  size_t j = (i < kColor_NumHueSteps ? i + 1 : i);
+  uint16_t s = (uint16_t)(saturation * 0xFFFF / 100);
+  uint16_t chroma = Scale(level, s);
+  for (size_t k = 0; k < 3; k++) {
+    uint16_t c = Lerp(hueTable[i][k], hueTable[j][k], pos & 0xFF);
+    rgbw[k] = Scale(chroma, c);
+  }
+  rgbw[kColorChannel_White] = Scale(level, 0xFFFF - s);
+}
+
+void ColorTemperatureToRGBW(uint32_t mireds, uint16_t level,
+                            uint16_t rgbw[kColorChannel_Count]) {
+  HAPPrecondition(rgbw);
+
+  if (mireds < kColor_MinMireds) mireds = kColor_MinMireds;
+  if (mireds > kColor_MaxMireds) mireds = kColor_MaxMireds;
+  uint32_t pos = ((mireds - kColor_MinMireds) << 8) / kColor_MiredsStep;
+  size_t i = pos >> 8;
+  size_t j = (i < kColor_NumTemperatures - 1 ? i + 1 : i);
+  for (size_t k = 0; k < kColorChannel_Count; k++) {
+    uint16_t c =
+        Lerp(temperatureTable[i][k], temperatureTable[j][k], pos & 0xFF);
+    rgbw[k] = Scale(level, c);
+  }
+}
@@ -0,0 +1,83 @@
+// Color conversion for the light outputs.
+//
+// Lights work in perceived levels (0 to kOutput_LevelMax). Converting a
+// HomeKit color to per-channel levels, and a perceived level to the level
+// driven onto a PWM output, goes through lookup tables that ColorInit fills
+// once; floating point is only used there. At run time every conversion is
+// a table lookup and a linear interpolation in integer arithmetic:
+//
+//   gamma              257 entries, app.output.gamma.
+//   hue                RGB at full saturation, kColor_NumHueSteps + 1 hues.
+//   color temperature  RGBW for 140 to 500 mireds in 10 mired steps.
+
+#ifndef COLOR_H
+#define COLOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Channels of a color light, in output order.
+ */
+typedef enum {
+  kColorChannel_Red,
+  kColorChannel_Green,
+  kColorChannel_Blue,
+  kColorChannel_White,
+  kColorChannel_Count
+} ColorChannel;
+
+/**
+ * Number of intervals of the hue table. A multiple of 6, so that the corners
+ * of the HSV hexagon fall on table entries.
+ */
+#define kColor_NumHueSteps ((size_t) 96)
+
+/**
+ * Color temperature range of the HomeKit characteristic, mireds.
+ */
+#define kColor_MinMireds ((uint32_t) 140)
+#define kColor_MaxMireds ((uint32_t) 500)
+
+/**
+ * Fill the lookup tables.
+ *
+ * @param gammaX100 Gamma times 100; 100 drives the outputs linearly.
+ */
+void ColorInit(uint32_t gammaX100);
+
+/**
+ * Output level for a perceived level.
+ */
+uint16_t ColorGamma(uint16_t level);
+
+/**
+ * Convert hue (degrees, 0 to 360), saturation (percent) and a perceived
+ * level to RGBW levels. The white channel carries the unsaturated part.
+ */
+void ColorHSVToRGBW(uint32_t hue, uint32_t saturation, uint16_t level,
+                    uint16_t rgbw[kColorChannel_Count]);
+
+/**
+ * Convert a color temperature (mireds, clamped to the HomeKit range) and a
+ * perceived level to RGBW levels.
+ */
+void ColorTemperatureToRGBW(uint32_t mireds, uint16_t level,
+                            uint16_t rgbw[kColorChannel_Count]);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
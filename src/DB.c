@@ -4,9 +4,11 @@
 // you may not use this file except in compliance with the License.
 // See [CONTRIBUTORS.md] for the list of HomeKit ADK project authors.
 
-// This file contains the accessory attribute database that defines the
-// accessory information service, HAP Protocol Information Service, the Pairing
-// service and finally the service signature exposed by the light bulb.
+// Generated by tools/gen_db.py from DB.json. Do not edit.
+
+// This file contains the accessory attribute database: the services and
+// characteristics exposed by the light bulb. The accessory information, HAP
+// Protocol Information and Pairing services are provided by mgos_hap.
 
 #include "DB.h"
 #include "App.h"
@@ -16,15 +18,22 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * IID constants.
+ * IIDs must be unique. They are allocated in increasing order.
  */
-
-#define kIID_LightBulb ((uint64_t) 0x0030)
-#define kIID_LightBulbServiceSignature ((uint64_t) 0x0031)
-#define kIID_LightBulbName ((uint64_t) 0x0032)
-#define kIID_LightBulbOn ((uint64_t) 0x0033)
-
-HAP_STATIC_ASSERT(kAttributeCount == 9 + 3 + 5 + 4, AttributeCount_mismatch);
+HAP_STATIC_ASSERT(kIID_LightBulbServiceSignature > kIID_LightBulb,
+                  kIID_LightBulbServiceSignature_order);
+HAP_STATIC_ASSERT(kIID_LightBulbName > kIID_LightBulbServiceSignature,
+                  kIID_LightBulbName_order);
+HAP_STATIC_ASSERT(kIID_LightBulbOn > kIID_LightBulbName,
+                  kIID_LightBulbOn_order);
+HAP_STATIC_ASSERT(kIID_LightBulbBrightness > kIID_LightBulbOn,
+                  kIID_LightBulbBrightness_order);
+HAP_STATIC_ASSERT(kIID_LightBulbHue > kIID_LightBulbBrightness,
+                  kIID_LightBulbHue_order);
+HAP_STATIC_ASSERT(kIID_LightBulbSaturation > kIID_LightBulbHue,
+                  kIID_LightBulbSaturation_order);
+HAP_STATIC_ASSERT(kIID_LightBulbColorTemperature > kIID_LightBulbSaturation,
+                  kIID_LightBulbColorTemperature_order);
 
 /**
  * The 'Service Signature' characteristic of the Light Bulb service.
@@ -41,7 +50,8 @@ static const HAPDataCharacteristic lightBulbServiceSignatureCharacteristic = {
                    .hidden = false,
                    .requiresTimedWrite = false,
                    .supportsAuthorizationData = false,
-                   .ip = {.controlPoint = true},
+                   .ip = {.controlPoint = true,
+                          .supportsWriteResponse = false},
                    .ble = {.supportsBroadcastNotification = false,
                            .supportsDisconnectedNotification = false,
                            .readableWithoutSecurity = false,
@@ -72,7 +82,8 @@ static const HAPStringCharacteristic lightBulbNameCharacteristic = {
                            .readableWithoutSecurity = false,
                            .writableWithoutSecurity = false}},
     .constraints = {.maxLength = 64},
-    .callbacks = {.handleRead = HAPHandleNameRead, .handleWrite = NULL}};
+    .callbacks = {.handleRead = HandleLightBulbNameRead,
+                  .handleWrite = NULL}};
 
 /**
  * The 'On' characteristic of the Light Bulb service.
@@ -99,17 +110,143 @@ const HAPBoolCharacteristic lightBulbOnCharacteristic = {
                   .handleWrite = HandleLightBulbOnWrite}};
 
 /**
- * The Light Bulb service that contains the 'On' characteristic.
+ * The 'Brightness' characteristic of the Light Bulb service.
+ */
+const HAPIntCharacteristic lightBulbBrightnessCharacteristic = {
+    .format = kHAPCharacteristicFormat_Int,
+    .iid = kIID_LightBulbBrightness,
+    .characteristicType = &kHAPCharacteristicType_Brightness,
+    .debugDescription = kHAPCharacteristicDebugDescription_Brightness,
+    .manufacturerDescription = NULL,
+    .properties = {.readable = true,
+                   .writable = true,
+                   .supportsEventNotification = true,
+                   .hidden = false,
+                   .requiresTimedWrite = false,
+                   .supportsAuthorizationData = false,
+                   .ip = {.controlPoint = false,
+                          .supportsWriteResponse = false},
+                   .ble = {.supportsBroadcastNotification = true,
+                           .supportsDisconnectedNotification = true,
+                           .readableWithoutSecurity = false,
+                           .writableWithoutSecurity = false}},
+    .units = kHAPCharacteristicUnits_Percentage,
+    .constraints = {.minimumValue = 0,
+                    .maximumValue = 100,
+                    .stepValue = 1},
+    .callbacks = {.handleRead = HandleLightBulbBrightnessRead,
+                  .handleWrite = HandleLightBulbBrightnessWrite}};
+
+/**
+ * The 'Hue' characteristic of the Light Bulb service.
+ */
+const HAPFloatCharacteristic lightBulbHueCharacteristic = {
+    .format = kHAPCharacteristicFormat_Float,
+    .iid = kIID_LightBulbHue,
+    .characteristicType = &kHAPCharacteristicType_Hue,
+    .debugDescription = kHAPCharacteristicDebugDescription_Hue,
+    .manufacturerDescription = NULL,
+    .properties = {.readable = true,
+                   .writable = true,
+                   .supportsEventNotification = true,
+                   .hidden = false,
+                   .requiresTimedWrite = false,
+                   .supportsAuthorizationData = false,
+                   .ip = {.controlPoint = false,
+                          .supportsWriteResponse = false},
+                   .ble = {.supportsBroadcastNotification = true,
+                           .supportsDisconnectedNotification = true,
+                           .readableWithoutSecurity = false,
+                           .writableWithoutSecurity = false}},
+    .units = kHAPCharacteristicUnits_ArcDegrees,
+    .constraints = {.minimumValue = 0.0f,
+                    .maximumValue = 360.0f,
+                    .stepValue = 1.0f},
+    .callbacks = {.handleRead = HandleLightBulbHueRead,
+                  .handleWrite = HandleLightBulbHueWrite}};
+
+/**
+ * The 'Saturation' characteristic of the Light Bulb service.
+ */
+const HAPFloatCharacteristic lightBulbSaturationCharacteristic = {
+    .format = kHAPCharacteristicFormat_Float,
+    .iid = kIID_LightBulbSaturation,
+    .characteristicType = &kHAPCharacteristicType_Saturation,
+    .debugDescription = kHAPCharacteristicDebugDescription_Saturation,
+    .manufacturerDescription = NULL,
+    .properties = {.readable = true,
+                   .writable = true,
+                   .supportsEventNotification = true,
+                   .hidden = false,
+                   .requiresTimedWrite = false,
+                   .supportsAuthorizationData = false,
+                   .ip = {.controlPoint = false,
+                          .supportsWriteResponse = false},
+                   .ble = {.supportsBroadcastNotification = true,
+                           .supportsDisconnectedNotification = true,
+                           .readableWithoutSecurity = false,
+                           .writableWithoutSecurity = false}},
+    .units = kHAPCharacteristicUnits_Percentage,
+    .constraints = {.minimumValue = 0.0f,
+                    .maximumValue = 100.0f,
+                    .stepValue = 1.0f},
+    .callbacks = {.handleRead = HandleLightBulbSaturationRead,
+                  .handleWrite = HandleLightBulbSaturationWrite}};
+
+/**
+ * The 'Color Temperature' characteristic of the Light Bulb service.
+ */
+const HAPUInt32Characteristic lightBulbColorTemperatureCharacteristic = {
+    .format = kHAPCharacteristicFormat_UInt32,
+    .iid = kIID_LightBulbColorTemperature,
+    .characteristicType = &kHAPCharacteristicType_ColorTemperature,
+    .debugDescription = kHAPCharacteristicDebugDescription_ColorTemperature,
+    .manufacturerDescription = NULL,
+    .properties = {.readable = true,
+                   .writable = true,
+                   .supportsEventNotification = true,
+                   .hidden = false,
+                   .requiresTimedWrite = false,
+                   .supportsAuthorizationData = false,
+                   .ip = {.controlPoint = false,
+                          .supportsWriteResponse = false},
+                   .ble = {.supportsBroadcastNotification = true,
+                           .supportsDisconnectedNotification = true,
+                           .readableWithoutSecurity = false,
+                           .writableWithoutSecurity = false}},
+    .constraints = {.minimumValue = 140,
+                    .maximumValue = 500,
+                    .stepValue = 1},
+    .callbacks = {.handleRead = HandleLightBulbColorTemperatureRead,
+                  .handleWrite = HandleLightBulbColorTemperatureWrite}};
+
+/**
+ * Characteristics of the Light Bulb service.
+ */
+static const HAPCharacteristic *const lightBulbServiceCharacteristics[] = {
+    &lightBulbServiceSignatureCharacteristic,
+    &lightBulbNameCharacteristic,
+    &lightBulbOnCharacteristic,
+    &lightBulbBrightnessCharacteristic,
+    &lightBulbHueCharacteristic,
+    &lightBulbSaturationCharacteristic,
+    &lightBulbColorTemperatureCharacteristic,
+    NULL};
+HAP_STATIC_ASSERT(HAPArrayCount(lightBulbServiceCharacteristics) ==
+                      kAttributeCount_LightBulb,
+                  kAttributeCount_LightBulb_mismatch);
+
+/**
+ * The Light Bulb service.
  */
-HAPService lightBulbService = {
+const HAPService lightBulbService = {
     .iid = kIID_LightBulb,
     .serviceType = &kHAPServiceType_LightBulb,
     .debugDescription = kHAPServiceDebugDescription_LightBulb,
-    .name = NULL,  // Set from config.
+    // The actual name is served by the Name read handler.
+    .name = CS_STRINGIFY_MACRO(HAP_SERVICE_NAME),
     .properties = {.primaryService = true,
                    .hidden = false,
                    .ble = {.supportsConfiguration = false}},
     .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic *const[]){
-        &lightBulbServiceSignatureCharacteristic, &lightBulbNameCharacteristic,
-        &lightBulbOnCharacteristic, NULL}};
+    .characteristics = lightBulbServiceCharacteristics};
@@ -4,8 +4,10 @@
 // you may not use this file except in compliance with the License.
 // See [CONTRIBUTORS.md] for the list of HomeKit ADK project authors.
 
-// Basic light bulb database example. This header file, and the corresponding
-// DB.c implementation in the ADK, is platform-independent.
+// Generated by tools/gen_db.py from DB.json. Do not edit.
+
+// Attribute database of the light bulb. This header file, and the
+// corresponding DB.c implementation, is platform-independent.
 
 #ifndef DB_H
 #define DB_H
@@ -21,14 +23,64 @@ extern "C" {
 #endif
 
 /**
- * Total number of services and characteristics contained in the accessory.
+ * IID constants.
+ */
+#define kIID_LightBulb ((uint64_t) 0x0030)
+#define kIID_LightBulbServiceSignature ((uint64_t) 0x0031)
+#define kIID_LightBulbName ((uint64_t) 0x0032)
+#define kIID_LightBulbOn ((uint64_t) 0x0033)
+#define kIID_LightBulbBrightness ((uint64_t) 0x0034)
+#define kIID_LightBulbHue ((uint64_t) 0x0035)
+#define kIID_LightBulbSaturation ((uint64_t) 0x0036)
+#define kIID_LightBulbColorTemperature ((uint64_t) 0x0037)
+
+/**
+ * Number of attributes (the service plus its characteristics) of each service.
+ */
+#define kAttributeCount_AccessoryInformation ((size_t) 9)
+#define kAttributeCount_ProtocolInformation ((size_t) 3)
+#define kAttributeCount_Pairing ((size_t) 5)
+#define kAttributeCount_LightBulb ((size_t) 8)
+
+/**
+ * Total number of services and characteristics contained in the standalone
+ * accessory. In bridge mode the count depends on the bridge table, see
+ * AppGetAttributeCount.
+ */
+#define kAttributeCount                                                       \
+  (kAttributeCount_AccessoryInformation +                                     \
+   kAttributeCount_ProtocolInformation + kAttributeCount_Pairing +            \
+   kAttributeCount_LightBulb)
+
+/**
+ * Light Bulb service. Shared by all lights in bridge mode.
+ */
+extern const HAPService lightBulbService;
+
+/**
+ * The 'On' characteristic of the Light Bulb service.
+ */
+extern const HAPBoolCharacteristic lightBulbOnCharacteristic;
+
+/**
+ * The 'Brightness' characteristic of the Light Bulb service.
+ */
+extern const HAPIntCharacteristic lightBulbBrightnessCharacteristic;
+
+/**
+ * The 'Hue' characteristic of the Light Bulb service.
+ */
+extern const HAPFloatCharacteristic lightBulbHueCharacteristic;
+
+/**
+ * The 'Saturation' characteristic of the Light Bulb service.
  */
-#define kAttributeCount ((size_t) 21)
+extern const HAPFloatCharacteristic lightBulbSaturationCharacteristic;
 
 /**
- * Light Bulb service.
+ * The 'Color Temperature' characteristic of the Light Bulb service.
  */
-extern HAPService lightBulbService;
+extern const HAPUInt32Characteristic lightBulbColorTemperatureCharacteristic;
 
 #if __has_feature(nullability)
 #pragma clang assume_nonnull end
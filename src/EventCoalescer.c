@@ -0,0 +1,89 @@
+// Event notification coalescing.
+
+#include "EventCoalescer.h"
+
+#include "mgos.h"
+
+typedef struct {
+  const HAPCharacteristic *characteristic;
+  const HAPService *service;
+  const HAPAccessory *accessory;
+} PendingEvent;
+
+static struct {
+  HAPAccessoryServerRef *_Nullable server;
+  PendingEvent pending[kEventCoalescer_MaxPending];
+  size_t numPending;
+  mgos_timer_id timer;
+  EventCoalescerStats stats;
+} coalescer;
+
+static void EventCoalescerTimerCallback(void *arg HAP_UNUSED) {
+  coalescer.timer = MGOS_INVALID_TIMER_ID;
+  EventCoalescerFlush();
+}
+
+void EventCoalescerRaise(HAPAccessoryServerRef *server,
+                         const HAPCharacteristic *characteristic,
+                         const HAPService *service,
+                         const HAPAccessory *accessory) {
+  HAPPrecondition(server);
+  HAPPrecondition(characteristic);
+  HAPPrecondition(service);
+  HAPPrecondition(accessory);
+
+  coalescer.stats.numChanged++;
+  if (coalescer.server != server) {
+    EventCoalescerFlush();
+    coalescer.server = server;
+  }
+  for (size_t i = 0; i < coalescer.numPending; i++) {
+    const PendingEvent *e = &coalescer.pending[i];
+    if (e->characteristic == characteristic && e->accessory == accessory) {
+      return;
+    }
+  }
+  if (coalescer.numPending == kEventCoalescer_MaxPending) {
+    EventCoalescerFlush();
+  }
+  coalescer.pending[coalescer.numPending++] = (PendingEvent){
+      .characteristic = characteristic,
+      .service = service,
+      .accessory = accessory};
+
+  int windowMs = mgos_sys_config_get_app_event_window_ms();
+  if (windowMs <= 0) {
+    EventCoalescerFlush();
+  } else if (coalescer.timer == MGOS_INVALID_TIMER_ID) {
+    coalescer.timer =
+        mgos_set_timer(windowMs, 0, EventCoalescerTimerCallback, NULL);
+  }
+}
+
+void EventCoalescerFlush(void) {
+  if (coalescer.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(coalescer.timer);
+    coalescer.timer = MGOS_INVALID_TIMER_ID;
+  }
+  for (size_t i = 0; i < coalescer.numPending; i++) {
+    const PendingEvent *e = &coalescer.pending[i];
+    HAPAccessoryServerRaiseEvent(coalescer.server, e->characteristic,
+                                 e->service, e->accessory);
+    coalescer.stats.numRaised++;
+  }
+  coalescer.numPending = 0;
+}
+
+void EventCoalescerReset(void) {
+  if (coalescer.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(coalescer.timer);
+    coalescer.timer = MGOS_INVALID_TIMER_ID;
+  }
+  coalescer.numPending = 0;
+}
+
+void EventCoalescerGetStats(EventCoalescerStats *stats) {
+  HAPPrecondition(stats);
+
+  *stats = coalescer.stats;
+}
@@ -0,0 +1,70 @@
+// Event notification coalescing.
+//
+// Characteristic changes are not passed to HAPAccessoryServerRaiseEvent right
+// away but collected for a short window. Repeated changes of the same
+// characteristic within the window collapse into one entry, and all entries
+// are raised together when the window closes, so the accessory server sends
+// one notification per subscribed session carrying the latest values.
+
+#ifndef EVENT_COALESCER_H
+#define EVENT_COALESCER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Maximum number of distinct characteristics pending at a time. When
+ * exceeded, pending events are raised early.
+ */
+#define kEventCoalescer_MaxPending ((size_t) 16)
+
+/**
+ * Event counters.
+ */
+typedef struct {
+  uint32_t numChanged;  // Changes reported by the app.
+  // Calls to HAPAccessoryServerRaiseEvent. The accessory server sends each to
+  // every session subscribed at the time; that count is not available.
+  uint32_t numRaised;
+} EventCoalescerStats;
+
+/**
+ * Report a changed characteristic. Raised after app.event_window_ms, or right
+ * away if the window is 0.
+ */
+void EventCoalescerRaise(HAPAccessoryServerRef *server,
+                         const HAPCharacteristic *characteristic,
+                         const HAPService *service,
+                         const HAPAccessory *accessory);
+
+/**
+ * Raise all pending events now.
+ */
+void EventCoalescerFlush(void);
+
+/**
+ * Drop all pending events, e.g. when the accessory server is stopped.
+ */
+void EventCoalescerReset(void);
+
+/**
+ * Get event counters.
+ */
+void EventCoalescerGetStats(EventCoalescerStats *stats);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
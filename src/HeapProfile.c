@@ -0,0 +1,145 @@
+// Heap profiler.
+
+#include "HeapProfile.h"
+
+#include "mgos.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_heap_caps.h"
+#elif CS_PLATFORM == CS_P_ESP8266 && APP_HEAP_PROFILE
+#include "umm_malloc.h"
+#endif
+
+size_t HeapProfileGetLargestFreeBlock(void) {
+#if CS_PLATFORM == CS_P_ESP32
+  return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#elif CS_PLATFORM == CS_P_ESP8266 && APP_HEAP_PROFILE
+  // umm_info walks the whole heap, so this is only done when profiling.
+  umm_info(NULL, 0);
+  return ummHeapInfo.maxFreeContiguousBlocks * 8 /* umm block size */;
+#else
+  return 0;
+#endif
+}
+
+#if APP_HEAP_PROFILE
+
+#include "mgos_rpc.h"
+
+typedef struct {
+  const void *_Nullable key;
+  int64_t startUs;
+  size_t freeAtStart;
+  uint8_t site;
+  bool used;
+} HeapProfileSpan;
+
+typedef struct {
+  uint32_t numSpans;     // Completed spans.
+  uint32_t numOpen;      // Spans currently open.
+  int64_t retainedBytes;  // Sum of heap retained by completed spans.
+  int32_t maxRetainedBytes;
+  uint32_t maxLifetimeMs;
+  uint64_t totalLifetimeMs;
+  uint32_t freeAfterLast;
+  uint32_t largestFreeBlockAfterLast;
+} HeapProfileSiteStats;
+
+static struct {
+  HeapProfileSpan spans[kHeapProfile_MaxOpenSpans];
+  HeapProfileSiteStats sites[kHeapProfileSite_Count];
+  uint32_t numOverflows;
+} profile;
+
+static const char *const siteNames[kHeapProfileSite_Count] = {
+    [kHeapProfileSite_AppCreate] = "app_create",
+    [kHeapProfileSite_Session] = "session",
+    [kHeapProfileSite_StateSave] = "state_save",
+};
+
+void HeapProfileBegin(HeapProfileSite site, const void *_Nullable key) {
+  for (size_t i = 0; i < kHeapProfile_MaxOpenSpans; i++) {
+    HeapProfileSpan *span = &profile.spans[i];
+    if (span->used) continue;
+    span->used = true;
+    span->site = (uint8_t) site;
+    span->key = key;
+    span->startUs = mgos_uptime_micros();
+    span->freeAtStart = mgos_get_free_heap_size();
+    profile.sites[site].numOpen++;
+    return;
+  }
+  profile.numOverflows++;
+}
+
+void HeapProfileEnd(HeapProfileSite site, const void *_Nullable key) {
+  for (size_t i = 0; i < kHeapProfile_MaxOpenSpans; i++) {
+    HeapProfileSpan *span = &profile.spans[i];
+    if (!span->used || span->site != site || span->key != key) continue;
+    HeapProfileSiteStats *stats = &profile.sites[site];
+    size_t freeNow = mgos_get_free_heap_size();
+    int32_t retained = (int32_t)(span->freeAtStart - freeNow);
+    uint32_t lifetimeMs =
+        (uint32_t)((mgos_uptime_micros() - span->startUs) / 1000);
+    stats->numSpans++;
+    stats->numOpen--;
+    stats->retainedBytes += retained;
+    if (retained > stats->maxRetainedBytes) stats->maxRetainedBytes = retained;
+    if (lifetimeMs > stats->maxLifetimeMs) stats->maxLifetimeMs = lifetimeMs;
+    stats->totalLifetimeMs += lifetimeMs;
+    stats->freeAfterLast = (uint32_t) freeNow;
+    stats->largestFreeBlockAfterLast =
+        (uint32_t) HeapProfileGetLargestFreeBlock();
+    span->used = false;
+    return;
+  }
+}
+
+static int HeapProfilePrintSites(struct json_out *out, va_list *ap HAP_UNUSED) {
+  int len = json_printf(out, "{");
+  for (size_t i = 0; i < kHeapProfileSite_Count; i++) {
+    const HeapProfileSiteStats *stats = &profile.sites[i];
+    len += json_printf(
+        out,
+        "%s%Q: {spans: %u, open: %u, retained: %lld, max_retained: %d, "
+        "avg_lifetime_ms: %u, max_lifetime_ms: %u, free_after: %u, "
+        "largest_free_after: %u}",
+        (i == 0 ? "" : ", "), siteNames[i], (unsigned) stats->numSpans,
+        (unsigned) stats->numOpen, (long long) stats->retainedBytes,
+        (int) stats->maxRetainedBytes,
+        (unsigned) (stats->numSpans > 0
+                        ? stats->totalLifetimeMs / stats->numSpans
+                        : 0),
+        (unsigned) stats->maxLifetimeMs, (unsigned) stats->freeAfterLast,
+        (unsigned) stats->largestFreeBlockAfterLast);
+  }
+  return len + json_printf(out, "}");
+}
+
+/**
+ * App.HeapProfile RPC: returns per-site statistics and the current heap state.
+ */
+static void HeapProfileRPCHandler(struct mg_rpc_request_info *ri,
+                                  void *cb_arg HAP_UNUSED,
+                                  struct mg_rpc_frame_info *fi HAP_UNUSED,
+                                  struct mg_str args HAP_UNUSED) {
+  mg_rpc_send_responsef(
+      ri,
+      "{free: %u, min_free: %u, largest_free: %u, overflows: %u, sites: %M}",
+      (unsigned) mgos_get_free_heap_size(),
+      (unsigned) mgos_get_min_free_heap_size(),
+      (unsigned) HeapProfileGetLargestFreeBlock(),
+      (unsigned) profile.numOverflows, HeapProfilePrintSites);
+}
+
+void HeapProfileInit(void) {
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.HeapProfile", "",
+                     HeapProfileRPCHandler, NULL);
+}
+
+#else
+
+void HeapProfileInit(void) {
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Heap profiler.
+//
+// Attributes heap usage to the phases of the accessory server lifecycle: app
+// creation, sessions (from accept to invalidate) and state saves. For each
+// site it records how often it ran, how long a span lived and how many bytes
+// of heap it retained, plus the free heap and largest free block afterwards,
+// which together expose both leaks and fragmentation building up under
+// session churn. Results are dumped by the App.HeapProfile RPC method.
+//
+// Enabled with the APP_HEAP_PROFILE cdef; the hooks compile to nothing
+// otherwise.
+
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+#ifndef APP_HEAP_PROFILE
+#define APP_HEAP_PROFILE 0
+#endif
+
+/**
+ * Profiled sites.
+ */
+typedef enum {
+  kHeapProfileSite_AppCreate,
+  kHeapProfileSite_Session,
+  kHeapProfileSite_StateSave,
+  kHeapProfileSite_Count
+} HeapProfileSite;
+
+/**
+ * Maximum number of spans open at the same time.
+ */
+#define kHeapProfile_MaxOpenSpans ((size_t) 40)
+
+#if APP_HEAP_PROFILE
+
+/**
+ * Open a span. Key distinguishes concurrent spans of the same site, e.g. the
+ * session.
+ */
+void HeapProfileBegin(HeapProfileSite site, const void *_Nullable key);
+
+/**
+ * Close the span opened with the same site and key.
+ */
+void HeapProfileEnd(HeapProfileSite site, const void *_Nullable key);
+
+#define HEAP_PROFILE_BEGIN(site, key) HeapProfileBegin((site), (key))
+#define HEAP_PROFILE_END(site, key) HeapProfileEnd((site), (key))
+
+#else
+
+#define HEAP_PROFILE_BEGIN(site, key) ((void) 0)
+#define HEAP_PROFILE_END(site, key) ((void) 0)
+
+#endif
+
+/**
+ * Size of the largest free heap block, or 0 if the platform cannot tell.
+ */
+size_t HeapProfileGetLargestFreeBlock(void);
+
+/**
+ * Register the App.HeapProfile RPC method. No-op if profiling is disabled.
+ */
+void HeapProfileInit(void);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,436 @@
+// Append-only log-structured key-value store.
+//
+// On-flash format: a sequence of records, each consisting of a 6 byte header
+// followed by the value bytes.
+//
+//   [0]    domain
+//   [1]    key
+//   [2..3] number of value bytes, little endian (0xFFFF for a removal)
+//   [4..5] Fletcher-16 checksum over bytes [0..3] and the value
+//
+// The latest record for a (domain, key) pair wins. Scanning stops at the first
+// record that fails the checksum, which is how a torn write at the end of the
+// log is detected.
+//
+// Compaction writes the live records to <file>.tmp and renames it over the
+// log. The log is only ever removed once the temporary file is complete, so
+// after a power cut a lone temporary file is a complete log and one next to
+// the log is a leftover.
+
+#include "LogKVStore.h"
+
+#include <stdio.h>
+
+/**
+ * Record size marker used for removals.
+ */
+#define kLogKVStore_Removed ((uint16_t) 0xFFFF)
+
+/**
+ * Size of the record header.
+ */
+#define kLogKVStore_HeaderBytes ((size_t) 6)
+
+/**
+ * Minimum amount of garbage before compaction is considered.
+ */
+#define kLogKVStore_CompactionThresholdBytes ((size_t) 4096)
+
+/**
+ * Delay between the set that triggered compaction and the compaction itself.
+ */
+#define kLogKVStore_CompactionDelayMs 5000
+
+HAP_STATIC_ASSERT((kLogKVStore_MaxEntries & (kLogKVStore_MaxEntries - 1)) == 0,
+                  LogKVStore_MaxEntries_not_power_of_2);
+
+static size_t RecordBytes(uint16_t numBytes) {
+  return kLogKVStore_HeaderBytes +
+         (numBytes == kLogKVStore_Removed ? 0 : numBytes);
+}
+
+static uint16_t Fletcher16(uint16_t sum, const void *bytes, size_t numBytes) {
+  const uint8_t *b = bytes;
+  uint16_t sum1 = sum & 0xFF, sum2 = sum >> 8;
+  for (size_t i = 0; i < numBytes; i++) {
+    sum1 = (sum1 + b[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+static void EncodeHeader(uint8_t header[kLogKVStore_HeaderBytes],
+                         HAPPlatformKeyValueStoreDomain domain,
+                         HAPPlatformKeyValueStoreKey key, uint16_t numBytes,
+                         const void *_Nullable bytes) {
+  header[0] = domain;
+  header[1] = key;
+  header[2] = numBytes & 0xFF;
+  header[3] = numBytes >> 8;
+  uint16_t checksum = Fletcher16(0, header, 4);
+  if (bytes != NULL) {
+    checksum = Fletcher16(checksum, bytes, numBytes);
+  }
+  header[4] = checksum & 0xFF;
+  header[5] = checksum >> 8;
+}
+
+/**
+ * Look up the index entry of a key, optionally claiming a free slot for it.
+ */
+static LogKVStoreEntry *_Nullable FindEntry(
+    LogKVStoreEntry entries[kLogKVStore_MaxEntries],
+    HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key,
+    bool create) {
+  size_t slot = ((size_t) domain * 31 + key) & (kLogKVStore_MaxEntries - 1);
+  for (size_t i = 0; i < kLogKVStore_MaxEntries; i++) {
+    LogKVStoreEntry *e = &entries[slot];
+    if (!e->used) {
+      if (!create) return NULL;
+      e->used = true;
+      e->domain = domain;
+      e->key = key;
+      e->numBytes = kLogKVStore_Removed;
+      return e;
+    }
+    if (e->domain == domain && e->key == key) return e;
+    slot = (slot + 1) & (kLogKVStore_MaxEntries - 1);
+  }
+  return NULL;
+}
+
+/**
+ * Point the index at a new record and update the live byte count.
+ */
+static void UpdateEntry(LogKVStore *kvs, LogKVStoreEntry *e, uint32_t offset,
+                        uint16_t numBytes) {
+  if (e->numBytes != kLogKVStore_Removed) {
+    kvs->liveBytes -= RecordBytes(e->numBytes);
+  }
+  e->offset = offset;
+  e->numBytes = numBytes;
+  if (numBytes != kLogKVStore_Removed) {
+    kvs->liveBytes += RecordBytes(numBytes);
+  }
+}
+
+static void CompactionTimerCallback(void *arg) {
+  LogKVStore *kvs = arg;
+  kvs->compactionTimer = MGOS_INVALID_TIMER_ID;
+  HAPError err = LogKVStoreCompact(kvs);
+  if (err) {
+    HAPLogError(&kHAPLog_Default, "%s: compaction of %s failed", __func__,
+                kvs->fileName);
+  }
+}
+
+static void MaybeScheduleCompaction(LogKVStore *kvs) {
+  size_t garbageBytes = kvs->logBytes - kvs->liveBytes;
+  if (kvs->compactionTimer != MGOS_INVALID_TIMER_ID ||
+      garbageBytes < kLogKVStore_CompactionThresholdBytes ||
+      garbageBytes < kvs->liveBytes) {
+    return;
+  }
+  kvs->compactionTimer = mgos_set_timer(kLogKVStore_CompactionDelayMs, 0,
+                                        CompactionTimerCallback, kvs);
+}
+
+static HAPError AppendRecord(LogKVStore *kvs,
+                             HAPPlatformKeyValueStoreDomain domain,
+                             HAPPlatformKeyValueStoreKey key,
+                             const void *_Nullable bytes, uint16_t numBytes) {
+  LogKVStoreEntry *e = FindEntry(kvs->entries, domain, key, true /* create */);
+  if (e == NULL) {
+    HAPLogError(&kHAPLog_Default, "%s: index full", __func__);
+    return kHAPError_Unknown;
+  }
+  uint8_t header[kLogKVStore_HeaderBytes];
+  EncodeHeader(header, domain, key, numBytes, bytes);
+  FILE *fp = fopen(kvs->fileName, "ab");
+  if (fp == NULL) {
+    HAPLogError(&kHAPLog_Default, "%s: cannot open %s", __func__,
+                kvs->fileName);
+    return kHAPError_Unknown;
+  }
+  bool ok = (fwrite(header, sizeof header, 1, fp) == 1);
+  if (ok && bytes != NULL && numBytes > 0) {
+    ok = (fwrite(bytes, numBytes, 1, fp) == 1);
+  }
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok) {
+    HAPLogError(&kHAPLog_Default, "%s: write to %s failed", __func__,
+                kvs->fileName);
+    return kHAPError_Unknown;
+  }
+  UpdateEntry(kvs, e, (uint32_t)(kvs->logBytes + sizeof header), numBytes);
+  kvs->logBytes += RecordBytes(numBytes);
+  MaybeScheduleCompaction(kvs);
+  return kHAPError_None;
+}
+
+static void TmpFileName(const LogKVStore *kvs, char *name, size_t maxBytes) {
+  snprintf(name, maxBytes, "%s.tmp", kvs->fileName);
+}
+
+static bool FileExists(const char *fileName) {
+  FILE *fp = fopen(fileName, "rb");
+  if (fp == NULL) return false;
+  fclose(fp);
+  return true;
+}
+
+/**
+ * Replace a file with another one.
+ */
+static bool ReplaceFile(const char *from, const char *to) {
+  if (rename(from, to) == 0) {
+    return true;
+  }
+  // Some file systems (SPIFFS) do not rename over an existing file.
+  remove(to);
+  return rename(from, to) == 0;
+}
+
+/**
+ * Settle a compaction that was interrupted between writing the temporary
+ * file and replacing the log with it.
+ */
+static void RecoverCompaction(const LogKVStore *kvs) {
+  char tmpFileName[64];
+  TmpFileName(kvs, tmpFileName, sizeof tmpFileName);
+  if (!FileExists(tmpFileName)) {
+    return;
+  }
+  if (FileExists(kvs->fileName)) {
+    HAPLogInfo(&kHAPLog_Default, "%s: removing stale %s", __func__,
+               tmpFileName);
+    remove(tmpFileName);
+  } else if (rename(tmpFileName, kvs->fileName) == 0) {
+    HAPLogInfo(&kHAPLog_Default, "%s: recovered %s from %s", __func__,
+               kvs->fileName, tmpFileName);
+  } else {
+    HAPLogError(&kHAPLog_Default, "%s: cannot rename %s", __func__,
+                tmpFileName);
+  }
+}
+
+/**
+ * Rebuild the index by scanning the log.
+ *
+ * @return Whether the whole log was valid.
+ */
+static bool ScanLog(LogKVStore *kvs) {
+  HAPRawBufferZero(kvs->entries, sizeof kvs->entries);
+  kvs->logBytes = 0;
+  kvs->liveBytes = 0;
+  FILE *fp = fopen(kvs->fileName, "rb");
+  if (fp == NULL) return true;  // No log yet.
+  bool valid = true;
+  uint8_t header[kLogKVStore_HeaderBytes];
+  uint8_t chunk[64];
+  while (fread(header, sizeof header, 1, fp) == 1) {
+    uint16_t numBytes = header[2] | (header[3] << 8);
+    uint16_t checksum = Fletcher16(0, header, 4);
+    size_t remaining = (numBytes == kLogKVStore_Removed ? 0 : numBytes);
+    while (remaining > 0) {
+      size_t n = (remaining < sizeof chunk ? remaining : sizeof chunk);
+      if (fread(chunk, n, 1, fp) != 1) break;
+      checksum = Fletcher16(checksum, chunk, n);
+      remaining -= n;
+    }
+    if (remaining > 0 ||
+        checksum != (uint16_t)(header[4] | (header[5] << 8))) {
+      valid = false;
+      break;
+    }
+    LogKVStoreEntry *e =
+        FindEntry(kvs->entries, header[0], header[1], true /* create */);
+    if (e == NULL) {
+      valid = false;
+      break;
+    }
+    UpdateEntry(kvs, e, (uint32_t)(kvs->logBytes + sizeof header), numBytes);
+    kvs->logBytes += RecordBytes(numBytes);
+  }
+  // A partial header at the end also counts as a torn record.
+  if (valid &&
+      (fseek(fp, 0, SEEK_END) != 0 || ftell(fp) != (long) kvs->logBytes)) {
+    valid = false;
+  }
+  fclose(fp);
+  return valid;
+}
+
+void LogKVStoreCreate(LogKVStore *kvs, const char *fileName) {
+  HAPPrecondition(kvs);
+  HAPPrecondition(fileName);
+
+  HAPRawBufferZero(kvs, sizeof *kvs);
+  kvs->fileName = fileName;
+  RecoverCompaction(kvs);
+  if (!ScanLog(kvs)) {
+    HAPLogError(&kHAPLog_Default,
+                "%s: %s is damaged after offset %lu, discarding the tail",
+                __func__, fileName, (unsigned long) kvs->logBytes);
+    // Records appended after a torn record would be unreachable, so rewrite
+    // the valid prefix right away. If that fails too, start over with an
+    // empty log rather than failing on every boot.
+    if (LogKVStoreCompact(kvs) != kHAPError_None) {
+      HAPLogError(&kHAPLog_Default, "%s: cannot rewrite %s, starting empty",
+                  __func__, fileName);
+      FILE *fp = fopen(fileName, "wb");
+      if (fp != NULL) {
+        fclose(fp);
+      }
+      HAPRawBufferZero(kvs->entries, sizeof kvs->entries);
+      kvs->logBytes = 0;
+      kvs->liveBytes = 0;
+    }
+  }
+  HAPLogInfo(&kHAPLog_Default, "%s: %s, %lu bytes, %lu live", __func__,
+             fileName, (unsigned long) kvs->logBytes,
+             (unsigned long) kvs->liveBytes);
+}
+
+void LogKVStoreRelease(LogKVStore *kvs) {
+  HAPPrecondition(kvs);
+
+  if (kvs->compactionTimer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(kvs->compactionTimer);
+    kvs->compactionTimer = MGOS_INVALID_TIMER_ID;
+  }
+}
+
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreGet(LogKVStoreRef kvs,
+                       HAPPlatformKeyValueStoreDomain domain,
+                       HAPPlatformKeyValueStoreKey key, void *_Nullable bytes,
+                       size_t maxBytes, size_t *_Nullable numBytes,
+                       bool *found) {
+  HAPPrecondition(kvs);
+  HAPPrecondition(!maxBytes || bytes);
+  HAPPrecondition((bytes == NULL) == (numBytes == NULL));
+  HAPPrecondition(found);
+
+  LogKVStoreEntry *e = FindEntry(kvs->entries, domain, key, false);
+  *found = (e != NULL && e->numBytes != kLogKVStore_Removed);
+  if (!*found || bytes == NULL) {
+    return kHAPError_None;
+  }
+  size_t n = (e->numBytes < maxBytes ? e->numBytes : maxBytes);
+  FILE *fp = fopen(kvs->fileName, "rb");
+  if (fp == NULL) {
+    return kHAPError_Unknown;
+  }
+  bool ok = (fseek(fp, e->offset, SEEK_SET) == 0) &&
+            (n == 0 || fread(bytes, n, 1, fp) == 1);
+  fclose(fp);
+  if (!ok) {
+    HAPLogError(&kHAPLog_Default, "%s: read from %s failed", __func__,
+                kvs->fileName);
+    return kHAPError_Unknown;
+  }
+  *numBytes = n;
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreSet(LogKVStoreRef kvs,
+                       HAPPlatformKeyValueStoreDomain domain,
+                       HAPPlatformKeyValueStoreKey key, const void *bytes,
+                       size_t numBytes) {
+  HAPPrecondition(kvs);
+  HAPPrecondition(bytes);
+  HAPPrecondition(numBytes <= kLogKVStore_MaxValueBytes);
+
+  return AppendRecord(kvs, domain, key, bytes, (uint16_t) numBytes);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreRemove(LogKVStoreRef kvs,
+                          HAPPlatformKeyValueStoreDomain domain,
+                          HAPPlatformKeyValueStoreKey key) {
+  HAPPrecondition(kvs);
+
+  LogKVStoreEntry *e = FindEntry(kvs->entries, domain, key, false);
+  if (e == NULL || e->numBytes == kLogKVStore_Removed) {
+    return kHAPError_None;
+  }
+  return AppendRecord(kvs, domain, key, NULL, kLogKVStore_Removed);
+}
+
+HAP_RESULT_USE_CHECK
+HAPError LogKVStorePurgeDomain(LogKVStoreRef kvs,
+                               HAPPlatformKeyValueStoreDomain domain) {
+  HAPPrecondition(kvs);
+
+  for (size_t i = 0; i < kLogKVStore_MaxEntries; i++) {
+    const LogKVStoreEntry *e = &kvs->entries[i];
+    if (!e->used || e->domain != domain) continue;
+    HAPError err = LogKVStoreRemove(kvs, e->domain, e->key);
+    if (err) {
+      return err;
+    }
+  }
+  return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreCompact(LogKVStoreRef kvs) {
+  HAPPrecondition(kvs);
+
+  char tmpFileName[64];
+  TmpFileName(kvs, tmpFileName, sizeof tmpFileName);
+  FILE *in = fopen(kvs->fileName, "rb");
+  FILE *out = fopen(tmpFileName, "wb");
+  if (out == NULL) {
+    if (in != NULL) fclose(in);
+    return kHAPError_Unknown;
+  }
+  LogKVStoreEntry entries[kLogKVStore_MaxEntries];
+  HAPRawBufferZero(entries, sizeof entries);
+  size_t logBytes = 0;
+  bool ok = true;
+  for (size_t i = 0; i < kLogKVStore_MaxEntries && ok; i++) {
+    const LogKVStoreEntry *e = &kvs->entries[i];
+    if (!e->used || e->numBytes == kLogKVStore_Removed) continue;
+    uint8_t *value = malloc(e->numBytes > 0 ? e->numBytes : 1);
+    ok = (value != NULL && in != NULL &&
+          fseek(in, e->offset, SEEK_SET) == 0 &&
+          (e->numBytes == 0 || fread(value, e->numBytes, 1, in) == 1));
+    if (ok) {
+      uint8_t header[kLogKVStore_HeaderBytes];
+      EncodeHeader(header, e->domain, e->key, e->numBytes, value);
+      ok = (fwrite(header, sizeof header, 1, out) == 1) &&
+           (e->numBytes == 0 || fwrite(value, e->numBytes, 1, out) == 1);
+    }
+    free(value);
+    if (ok) {
+      LogKVStoreEntry *ne = FindEntry(entries, e->domain, e->key, true);
+      ne->offset = (uint32_t)(logBytes + kLogKVStore_HeaderBytes);
+      ne->numBytes = e->numBytes;
+      logBytes += RecordBytes(e->numBytes);
+    }
+  }
+  if (in != NULL) fclose(in);
+  ok = (fclose(out) == 0) && ok;
+  if (!ok) {
+    remove(tmpFileName);
+    return kHAPError_Unknown;
+  }
+  if (!ReplaceFile(tmpFileName, kvs->fileName)) {
+    HAPLogError(&kHAPLog_Default, "%s: cannot replace %s", __func__,
+                kvs->fileName);
+    // Keep the index in line with whichever copy survived.
+    RecoverCompaction(kvs);
+    ScanLog(kvs);
+    return kHAPError_Unknown;
+  }
+  HAPLogInfo(&kHAPLog_Default, "%s: %s %lu -> %lu bytes", __func__,
+             kvs->fileName, (unsigned long) kvs->logBytes,
+             (unsigned long) logBytes);
+  HAPRawBufferCopyBytes(kvs->entries, entries, sizeof entries);
+  kvs->logBytes = logBytes;
+  kvs->liveBytes = logBytes;
+  return kHAPError_None;
+}
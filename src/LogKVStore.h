@@ -0,0 +1,128 @@
+// Append-only log-structured key-value store.
+//
+// Every set or remove appends a small record to the end of a single file
+// instead of rewriting the whole store, and an in-RAM index maps each
+// (domain, key) pair to the offset of its latest value. Superseded records are
+// dropped by a compaction pass that is scheduled from a timer once the log has
+// accumulated enough garbage, so it never runs inside a HAP request.
+//
+// The interface mirrors HAPPlatformKeyValueStore so the two are
+// interchangeable for application data.
+
+#ifndef LOG_KV_STORE_H
+#define LOG_KV_STORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#include "mgos.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Maximum number of distinct keys tracked by the index. Must be a power of 2.
+ */
+#define kLogKVStore_MaxEntries ((size_t) 32)
+
+/**
+ * Maximum size of a single value.
+ */
+#define kLogKVStore_MaxValueBytes ((size_t) 0xFFFE)
+
+/**
+ * Index entry.
+ */
+typedef struct {
+  uint32_t offset;    // Offset of the value bytes in the log.
+  uint16_t numBytes;  // kLogKVStore_Removed if the key has been removed.
+  HAPPlatformKeyValueStoreDomain domain;
+  HAPPlatformKeyValueStoreKey key;
+  bool used;
+} LogKVStoreEntry;
+
+/**
+ * Log-structured key-value store.
+ */
+typedef struct {
+  const char *fileName;
+  LogKVStoreEntry entries[kLogKVStore_MaxEntries];
+  size_t logBytes;   // Total size of the log file.
+  size_t liveBytes;  // Bytes taken by records that are still current.
+  mgos_timer_id compactionTimer;
+} LogKVStore;
+
+typedef LogKVStore *LogKVStoreRef;
+
+/**
+ * Open the log at the given path and rebuild the index from it.
+ *
+ * A torn record at the end of the log (e.g. from a power cut mid-write) is
+ * discarded. If the rest cannot be rewritten, the log starts out empty.
+ */
+void LogKVStoreCreate(LogKVStore *kvs, const char *fileName);
+
+/**
+ * Cancel pending compaction.
+ */
+void LogKVStoreRelease(LogKVStore *kvs);
+
+/**
+ * Fetch the value of a key.
+ *
+ * @return kHAPError_None   If successful (including when not found).
+ * @return kHAPError_Unknown If an I/O error occurred.
+ */
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreGet(LogKVStoreRef kvs,
+                       HAPPlatformKeyValueStoreDomain domain,
+                       HAPPlatformKeyValueStoreKey key, void *_Nullable bytes,
+                       size_t maxBytes, size_t *_Nullable numBytes,
+                       bool *found);
+
+/**
+ * Set the value of a key by appending a record to the log.
+ *
+ * @return kHAPError_None   If successful.
+ * @return kHAPError_Unknown If an I/O error occurred or the index is full.
+ */
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreSet(LogKVStoreRef kvs,
+                       HAPPlatformKeyValueStoreDomain domain,
+                       HAPPlatformKeyValueStoreKey key, const void *bytes,
+                       size_t numBytes);
+
+/**
+ * Remove a key by appending a tombstone record to the log.
+ */
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreRemove(LogKVStoreRef kvs,
+                          HAPPlatformKeyValueStoreDomain domain,
+                          HAPPlatformKeyValueStoreKey key);
+
+/**
+ * Remove all keys of a domain.
+ */
+HAP_RESULT_USE_CHECK
+HAPError LogKVStorePurgeDomain(LogKVStoreRef kvs,
+                               HAPPlatformKeyValueStoreDomain domain);
+
+/**
+ * Rewrite the log keeping only current records.
+ */
+HAP_RESULT_USE_CHECK
+HAPError LogKVStoreCompact(LogKVStoreRef kvs);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
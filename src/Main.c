@@ -6,6 +6,12 @@
 
 #include "App.h"
 #include "DB.h"
+#include "EventCoalescer.h"
+#include "HeapProfile.h"
+#include "LogKVStore.h"
+#include "Metrics.h"
+#include "SessionRegistry.h"
+#include "Trace.h"
 
 #include "HAP.h"
 #include "HAPPlatform+Init.h"
@@ -27,7 +33,15 @@
 static bool requestedFactoryReset = false;
 static bool clearPairings = false;
 
-#define MAX_NUM_SESSIONS 8
+/**
+ * Upper bound for app.max_sessions. Every session must fit the registry.
+ */
+#define MAX_NUM_SESSIONS ((int) kSessionRegistry_MaxSessions)
+
+/**
+ * Lower bound for app.scratch_buffer_size.
+ */
+#define MIN_SCRATCH_BUFFER_SIZE 1024
 
 #define PREFERRED_ADVERTISING_INTERVAL \
   (HAPBLEAdvertisingIntervalCreateFromMilliseconds(417.5f))
@@ -38,6 +52,8 @@ static bool clearPairings = false;
  */
 static struct {
   HAPPlatformKeyValueStore keyValueStore;
+  LogKVStore stateLog;
+  bool haveStateLog;
   HAPAccessoryServerOptions hapAccessoryServerOptions;
   HAPPlatform hapPlatform;
   HAPAccessoryServerCallbacks hapAccessoryServerCallbacks;
@@ -48,6 +64,7 @@ static struct {
 
 #if IP
   HAPPlatformTCPStreamManager tcpStreamManager;
+  size_t numSessions;
 #endif
 } platform;
 
@@ -64,7 +81,8 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
  */
 extern void AppRelease(void);
 extern void AppCreate(HAPAccessoryServerRef *server,
-                      HAPPlatformKeyValueStoreRef keyValueStore);
+                      HAPPlatformKeyValueStoreRef keyValueStore,
+                      LogKVStoreRef _Nullable stateLog);
 extern void AppInitialize(
     HAPAccessoryServerOptions *hapAccessoryServerOptions,
     HAPPlatform *hapPlatform,
@@ -76,10 +94,15 @@ extern void AccessoryServerHandleUpdatedState(HAPAccessoryServerRef *server,
 
 static void timer_cb(void *arg) {
   static bool s_tick_tock = false;
+  EventCoalescerStats eventStats;
+  EventCoalescerGetStats(&eventStats);
   LOG(LL_INFO,
-      ("%s uptime: %.2lf, RAM: %lu, %lu free", (s_tick_tock ? "Tick" : "Tock"),
-       mgos_uptime(), (unsigned long) mgos_get_heap_size(),
-       (unsigned long) mgos_get_free_heap_size()));
+      ("%s uptime: %.2lf, RAM: %lu, %lu free, events: %lu changed, %lu raised",
+       (s_tick_tock ? "Tick" : "Tock"), mgos_uptime(),
+       (unsigned long) mgos_get_heap_size(),
+       (unsigned long) mgos_get_free_heap_size(),
+       (unsigned long) eventStats.numChanged,
+       (unsigned long) eventStats.numRaised));
   s_tick_tock = !s_tick_tock;
   (void) arg;
 }
@@ -94,6 +117,13 @@ static void InitializePlatform() {
       &(const HAPPlatformKeyValueStoreOptions){.fileName = "kv.json"});
   platform.hapPlatform.keyValueStore = &platform.keyValueStore;
 
+  // App state log.
+  const char *stateLogFileName = mgos_sys_config_get_app_state_log();
+  if (stateLogFileName != NULL && stateLogFileName[0] != '\0') {
+    LogKVStoreCreate(&platform.stateLog, stateLogFileName);
+    platform.haveStateLog = true;
+  }
+
   // Accessory setup manager. Depends on key-value store.
   static HAPPlatformAccessorySetup accessorySetup;
   HAPPlatformAccessorySetupCreate(&accessorySetup,
@@ -101,13 +131,25 @@ static void InitializePlatform() {
   platform.hapPlatform.accessorySetup = &accessorySetup;
 
 #if IP
+  int numSessions = mgos_sys_config_get_app_max_sessions();
+  if (numSessions < 1 || numSessions > MAX_NUM_SESSIONS) {
+    int clamped = (numSessions < 1 ? 1 : MAX_NUM_SESSIONS);
+    LOG(LL_ERROR, ("app.max_sessions must be between 1 and %d, using %d",
+                   MAX_NUM_SESSIONS, clamped));
+    numSessions = clamped;
+  }
+  platform.numSessions = (size_t) numSessions;
+
   // TCP stream manager.
   HAPPlatformTCPStreamManagerCreate(
       &platform.tcpStreamManager,
       &(const HAPPlatformTCPStreamManagerOptions){
-          .port = kHAPNetworkPort_Any,  // Listen on unused port number from the
-                                        // ephemeral port range.
-          .maxConcurrentTCPStreams = MAX_NUM_SESSIONS});
+          // If not configured, listen on unused port number from the
+          // ephemeral port range.
+          .port = (mgos_sys_config_get_app_hap_port() > 0
+                       ? (uint16_t) mgos_sys_config_get_app_hap_port()
+                       : kHAPNetworkPort_Any),
+          .maxConcurrentTCPStreams = platform.numSessions});
 
   // Service discovery.
   static HAPPlatformServiceDiscovery serviceDiscovery;
@@ -134,14 +176,26 @@ static void InitializePlatform() {
       kHAPPairingStorage_MinElements;
 
   platform.hapAccessoryServerCallbacks.handleUpdatedState = HandleUpdatedState;
-
-  mgos_set_timer(1000, MGOS_TIMER_REPEAT, timer_cb, NULL);
+  platform.hapAccessoryServerCallbacks.handleSessionAccept =
+      AccessoryServerHandleSessionAccept;
+  platform.hapAccessoryServerCallbacks.handleSessionInvalidate =
+      AccessoryServerHandleSessionInvalidate;
+
+  // Status line in the log. Monitoring should use App.Metrics instead.
+  int statusLogIntervalMs = mgos_sys_config_get_app_status_log_interval_ms();
+  if (statusLogIntervalMs > 0) {
+    mgos_set_timer(statusLogIntervalMs, MGOS_TIMER_REPEAT, timer_cb, NULL);
+  }
 }
 
 /**
  * Deinitialize global platform objects.
  */
 void DeinitializePlatform() {
+  if (platform.haveStateLog) {
+    LogKVStoreRelease(&platform.stateLog);
+  }
+
 #if IP
   // TCP stream manager.
   HAPPlatformTCPStreamManagerRelease(&platform.tcpStreamManager);
@@ -172,6 +226,9 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
 
     HAPLogInfo(&kHAPLog_Default, "A factory reset has been requested.");
 
+    // Write out deferred app state now so it cannot land after the purge.
+    AppFlushAccessoryState();
+
     // Purge app state.
     err = HAPPlatformKeyValueStorePurgeDomain(
         &platform.keyValueStore, ((HAPPlatformKeyValueStoreDomain) 0x00));
@@ -179,6 +236,14 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
       HAPAssert(err == kHAPError_Unknown);
       HAPFatalError();
     }
+    if (platform.haveStateLog) {
+      err = LogKVStorePurgeDomain(&platform.stateLog,
+                                  ((HAPPlatformKeyValueStoreDomain) 0x00));
+      if (err) {
+        HAPAssert(err == kHAPError_Unknown);
+        HAPFatalError();
+      }
+    }
 
     // Reset HomeKit state.
     err = HAPRestoreFactorySettings(&platform.keyValueStore);
@@ -196,7 +261,8 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
     requestedFactoryReset = false;
 
     // Re-initialize App.
-    AppCreate(server, &platform.keyValueStore);
+    AppCreate(server, &platform.keyValueStore,
+              platform.haveStateLog ? &platform.stateLog : NULL);
 
     // Restart accessory server.
     AppAccessoryServerStart();
@@ -219,13 +285,42 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
 #if IP
 static void InitializeIP() {
   // Prepare accessory server storage.
-  static HAPIPSession ipSessions[MAX_NUM_SESSIONS];
-  static uint8_t ipScratchBuffer[1536];
-  static HAPIPAccessoryServerStorage ipAccessoryServerStorage = {
-      .sessions = ipSessions,
-      .numSessions = HAPArrayCount(ipSessions),
-      .scratchBuffer = {.bytes = ipScratchBuffer,
-                        .numBytes = sizeof ipScratchBuffer}};
+  // The session pool is allocated once here and lives for the lifetime of
+  // the firmware, so it does not fragment the heap.
+  size_t freeHeapBefore = mgos_get_free_heap_size();
+  HAPIPSession *ipSessions = calloc(platform.numSessions, sizeof *ipSessions);
+  if (ipSessions == NULL) {
+    LOG(LL_ERROR, ("Failed to allocate %u sessions",
+                   (unsigned) platform.numSessions));
+    HAPFatalError();
+  }
+  // The scratch buffer holds a complete serialized response, so it limits the
+  // size of /accessories and of multi-characteristic reads. Requests are
+  // processed one at a time on the run loop, so one buffer is shared by all
+  // sessions.
+  int scratchBufferSize = mgos_sys_config_get_app_scratch_buffer_size();
+  if (scratchBufferSize < MIN_SCRATCH_BUFFER_SIZE) {
+    LOG(LL_ERROR, ("app.scratch_buffer_size must be at least %d",
+                   MIN_SCRATCH_BUFFER_SIZE));
+    scratchBufferSize = MIN_SCRATCH_BUFFER_SIZE;
+  }
+  uint8_t *ipScratchBuffer = malloc(scratchBufferSize);
+  if (ipScratchBuffer == NULL) {
+    LOG(LL_ERROR, ("Failed to allocate %d byte scratch buffer",
+                   scratchBufferSize));
+    HAPFatalError();
+  }
+  static HAPIPAccessoryServerStorage ipAccessoryServerStorage;
+  ipAccessoryServerStorage.sessions = ipSessions;
+  ipAccessoryServerStorage.numSessions = platform.numSessions;
+  ipAccessoryServerStorage.scratchBuffer.bytes = ipScratchBuffer;
+  ipAccessoryServerStorage.scratchBuffer.numBytes = (size_t) scratchBufferSize;
+  LOG(LL_INFO, ("IP sessions: %u x %u bytes, scratch buffer: %d bytes, "
+                "%u bytes of heap used, %u free",
+                (unsigned) platform.numSessions, (unsigned) sizeof *ipSessions,
+                scratchBufferSize,
+                (unsigned) (freeHeapBefore - mgos_get_free_heap_size()),
+                (unsigned) mgos_get_free_heap_size()));
 
   platform.hapAccessoryServerOptions.ip.transport =
       &kHAPAccessoryServerTransport_IP;
@@ -293,7 +388,8 @@ enum mgos_app_init_result mgos_app_init(void) {
       /* context: */ NULL);
 
   // Create app object.
-  AppCreate(&accessoryServer, &platform.keyValueStore);
+  AppCreate(&accessoryServer, &platform.keyValueStore,
+            platform.haveStateLog ? &platform.stateLog : NULL);
 
   // Start accessory server for App.
   if (mgos_hap_config_valid()) {
@@ -303,6 +399,10 @@ enum mgos_app_init_result mgos_app_init(void) {
   }
 
   mgos_hap_add_rpc_service(&accessoryServer, AppGetAccessoryInfo());
+  HeapProfileInit();
+  MetricsInit();
+  SessionRegistryInit(&platform.keyValueStore);
+  TraceInit();
 
   return MGOS_APP_INIT_SUCCESS;
 }
@@ -0,0 +1,123 @@
+// Runtime metrics.
+
+#include "Metrics.h"
+#include "AsyncWrite.h"
+#include "EventCoalescer.h"
+#include "HeapProfile.h"
+#include "SessionRegistry.h"
+#include "Transition.h"
+#include "ValueCache.h"
+#include "WriteBatch.h"
+
+#include "mgos_rpc.h"
+
+uint32_t metricsCounters[kMetricsCounter_Count];
+
+static uint32_t histograms[kMetricsHistogram_Count][kMetrics_NumBuckets];
+
+static const char *const counterNames[kMetricsCounter_Count] = {
+    [kMetricsCounter_Reads] = "reads",
+    [kMetricsCounter_Writes] = "writes",
+    [kMetricsCounter_StateSaves] = "state_saves",
+    [kMetricsCounter_StateSaveBytes] = "state_save_bytes",
+    [kMetricsCounter_ButtonPresses] = "button_presses",
+};
+
+static const char *const histogramNames[kMetricsHistogram_Count] = {
+    [kMetricsHistogram_Read] = "read_us",
+    [kMetricsHistogram_Write] = "write_us",
+    [kMetricsHistogram_StateSave] = "state_save_us",
+    [kMetricsHistogram_Output] = "output_us",
+    [kMetricsHistogram_Button] = "button_us",
+};
+
+void MetricsRecordLatency(MetricsHistogram histogram, int64_t startUs) {
+  MetricsRecordDuration(histogram, mgos_uptime_micros() - startUs);
+}
+
+void MetricsRecordDuration(MetricsHistogram histogram, int64_t us) {
+  size_t bucket = 0;
+  if (us > 0) {
+    bucket = 32 - __builtin_clz((uint32_t)(us > 0x7FFFFFFF ? 0x7FFFFFFF : us));
+    if (bucket >= kMetrics_NumBuckets) bucket = kMetrics_NumBuckets - 1;
+  }
+  histograms[histogram][bucket]++;
+}
+
+static int MetricsPrintCounters(struct json_out *out, va_list *ap HAP_UNUSED) {
+  int len = json_printf(out, "{");
+  for (size_t i = 0; i < kMetricsCounter_Count; i++) {
+    len += json_printf(out, "%s%Q: %u", (i == 0 ? "" : ", "), counterNames[i],
+                       (unsigned) metricsCounters[i]);
+  }
+  return len + json_printf(out, "}");
+}
+
+static int MetricsPrintHistograms(struct json_out *out,
+                                  va_list *ap HAP_UNUSED) {
+  int len = json_printf(out, "{");
+  for (size_t i = 0; i < kMetricsHistogram_Count; i++) {
+    len += json_printf(out, "%s%Q: [", (i == 0 ? "" : ", "), histogramNames[i]);
+    for (size_t j = 0; j < kMetrics_NumBuckets; j++) {
+      len += json_printf(out, "%s%u", (j == 0 ? "" : ","),
+                         (unsigned) histograms[i][j]);
+    }
+    len += json_printf(out, "]");
+  }
+  return len + json_printf(out, "}");
+}
+
+/**
+ * App.Metrics RPC: returns all metrics. Histograms are arrays of bucket counts,
+ * see kMetrics_NumBuckets.
+ */
+static void MetricsRPCHandler(struct mg_rpc_request_info *ri,
+                              void *cb_arg HAP_UNUSED,
+                              struct mg_rpc_frame_info *fi HAP_UNUSED,
+                              struct mg_str args HAP_UNUSED) {
+  EventCoalescerStats eventStats;
+  EventCoalescerGetStats(&eventStats);
+  ValueCacheStats cacheStats;
+  ValueCacheGetStats(&cacheStats);
+  WriteBatchStats batchStats;
+  WriteBatchGetStats(&batchStats);
+  AsyncWriteStats asyncStats;
+  AsyncWriteGetStats(&asyncStats);
+  TransitionStats transitionStats;
+  TransitionGetStats(&transitionStats);
+  mg_rpc_send_responsef(
+      ri,
+      "{uptime: %.3lf, "
+      "heap: {size: %u, free: %u, min_free: %u, largest_free: %u}, "
+      "events: {changed: %u, raised: %u}, "
+      "cache: {hits: %u, misses: %u, published: %u, version: %u}, "
+      "write_batch: {writes: %u, commits: %u}, "
+      "actuator: {pending: %u, started: %u, failed: %u, timed_out: %u, "
+      "superseded: %u, max_ms: %u}, "
+      "transition: {frames: %u, channel_frames: %u, busy_us: %u, "
+      "max_frame_us: %u}, "
+      "sessions_active: %u, "
+      "counters: %M, histograms: %M}",
+      mgos_uptime(), (unsigned) mgos_get_heap_size(),
+      (unsigned) mgos_get_free_heap_size(),
+      (unsigned) mgos_get_min_free_heap_size(),
+      (unsigned) HeapProfileGetLargestFreeBlock(),
+      (unsigned) eventStats.numChanged, (unsigned) eventStats.numRaised,
+      (unsigned) cacheStats.numHits, (unsigned) cacheStats.numMisses,
+      (unsigned) cacheStats.numPublished,
+      (unsigned) ValueCacheGetLatestVersion(),
+      (unsigned) batchStats.numWrites, (unsigned) batchStats.numCommits,
+      (unsigned) AsyncWriteGetNumPending(), (unsigned) asyncStats.numStarted,
+      (unsigned) asyncStats.numFailed, (unsigned) asyncStats.numTimedOut,
+      (unsigned) asyncStats.numSuperseded, (unsigned) asyncStats.maxLatencyMs,
+      (unsigned) transitionStats.numFrames,
+      (unsigned) transitionStats.numChannelFrames,
+      (unsigned) transitionStats.busyUs, (unsigned) transitionStats.maxFrameUs,
+      (unsigned) SessionRegistryGetNumActive(),
+      MetricsPrintCounters, MetricsPrintHistograms);
+}
+
+void MetricsInit(void) {
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.Metrics", "",
+                     MetricsRPCHandler, NULL);
+}
@@ -0,0 +1,93 @@
+// Runtime metrics.
+//
+// Counters are plain 32-bit increments on the main loop, cheap enough for the
+// characteristic handlers. Latency histograms use power-of-2 microsecond
+// buckets. Everything, plus heap and event statistics, is reported by the
+// App.Metrics RPC method.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#include "mgos.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Counters.
+ */
+typedef enum {
+  kMetricsCounter_Reads,
+  kMetricsCounter_Writes,
+  kMetricsCounter_StateSaves,
+  kMetricsCounter_StateSaveBytes,
+  kMetricsCounter_ButtonPresses,
+  kMetricsCounter_Count
+} MetricsCounter;
+
+/**
+ * Latency histograms.
+ */
+typedef enum {
+  kMetricsHistogram_Read,
+  kMetricsHistogram_Write,
+  kMetricsHistogram_StateSave,
+  kMetricsHistogram_Output,  // Queued to output changed, see Output.h.
+  kMetricsHistogram_Button,  // Button edge to notification, see Button.h.
+  kMetricsHistogram_Count
+} MetricsHistogram;
+
+/**
+ * Number of histogram buckets. Bucket 0 counts latencies below 1 us, bucket i
+ * latencies in [2^(i-1), 2^i) us, and the last bucket everything above.
+ */
+#define kMetrics_NumBuckets 16
+
+extern uint32_t metricsCounters[kMetricsCounter_Count];
+
+static inline void MetricsIncrement(MetricsCounter counter) {
+  metricsCounters[counter]++;
+}
+
+static inline void MetricsAdd(MetricsCounter counter, uint32_t n) {
+  metricsCounters[counter] += n;
+}
+
+/**
+ * Timestamp to pass to MetricsRecordLatency.
+ */
+static inline int64_t MetricsNow(void) {
+  return mgos_uptime_micros();
+}
+
+/**
+ * Record the time elapsed since startUs (from MetricsNow).
+ */
+void MetricsRecordLatency(MetricsHistogram histogram, int64_t startUs);
+
+/**
+ * Record a duration measured elsewhere, e.g. on another task.
+ */
+void MetricsRecordDuration(MetricsHistogram histogram, int64_t us);
+
+/**
+ * Register the App.Metrics RPC method.
+ */
+void MetricsInit(void);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
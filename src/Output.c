@@ -0,0 +1,410 @@
+// Light outputs.
+
+#include "Output.h"
+#include "Metrics.h"
+#include "SPSCQueue.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#ifndef APP_OUTPUT_HW
+#define APP_OUTPUT_HW 0
+#endif
+
+#ifndef APP_OUTPUT_TASK
+#define APP_OUTPUT_TASK 0
+#endif
+
+#if APP_OUTPUT_HW
+#include "mgos_gpio.h"
+#include "mgos_i2c.h"
+#include "mgos_pwm.h"
+#endif
+
+#if APP_OUTPUT_TASK
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+/**
+ * Maximum number of pins listed in app.output.pins.
+ */
+#define kOutput_MaxPins ((size_t) 16)
+
+/**
+ * Minimum number of commands the queue holds.
+ */
+#define kOutput_MinQueueSize ((size_t) 32)
+
+#if APP_OUTPUT_TASK
+/**
+ * Stack size of the output task, bytes.
+ */
+#define kOutput_TaskStackSize 3072
+#endif
+
+typedef struct {
+  uint16_t channel;
+  uint16_t level;
+  AsyncWriteID id;
+  int64_t queuedUs;
+} OutputCommand;
+
+/**
+ * A command after the driver has run.
+ */
+typedef struct {
+  OutputCommand command;
+  HAPError err;
+  bool changed;  // The level was written to the hardware.
+  int64_t appliedUs;
+} OutputResult;
+
+typedef struct {
+  const char *name;
+  bool (*init)(void);
+  HAPError (*set)(size_t channel, uint16_t level);
+} OutputDriver;
+
+static struct {
+  const OutputDriver *driver;
+  OutputAppliedCallback applied;
+  int64_t delayUs;  // Simulated response time of the sim driver.
+  size_t numChannels;
+  uint16_t *levels;     // Written by the driver side only.
+  int64_t *changedUs;  // Time of the last change per channel.
+  int pins[kOutput_MaxPins];
+  size_t numPins;
+  SPSCQueue queue;  // OutputSet to the driver side.
+  OutputCommand *commands;
+  volatile bool drainScheduled;
+#if APP_OUTPUT_TASK
+  TaskHandle_t task;
+  SPSCQueue results;  // Output task to the main loop.
+  OutputResult *resultBuffer;
+  volatile bool resultsScheduled;
+#endif
+} output;
+
+static HAPError SimSet(size_t channel HAP_UNUSED, uint16_t level HAP_UNUSED) {
+  return kHAPError_None;
+}
+
+static const OutputDriver simDriver = {.name = "sim", .set = SimSet};
+
+#if APP_OUTPUT_HW
+static bool Pin(size_t channel, int *pin) {
+  if (channel >= output.numPins) {
+    return false;
+  }
+  *pin = output.pins[channel];
+  return true;
+}
+
+static bool GPIOInit(void) {
+  for (size_t i = 0; i < output.numPins; i++) {
+    if (!mgos_gpio_setup_output(output.pins[i],
+                                mgos_sys_config_get_app_output_active_low())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static HAPError GPIOSet(size_t channel, uint16_t level) {
+  int pin;
+  if (!Pin(channel, &pin)) {
+    return kHAPError_InvalidState;
+  }
+  mgos_gpio_write(pin,
+                  (level != 0) != mgos_sys_config_get_app_output_active_low());
+  return kHAPError_None;
+}
+
+static bool PWMSetPin(int pin, uint16_t level) {
+  float duty = (float) level / kOutput_LevelMax;
+  if (mgos_sys_config_get_app_output_active_low()) {
+    duty = 1.0f - duty;
+  }
+  return mgos_pwm_set(pin, mgos_sys_config_get_app_output_pwm_freq(), duty);
+}
+
+static bool PWMInit(void) {
+  for (size_t i = 0; i < output.numPins; i++) {
+    if (!PWMSetPin(output.pins[i], 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static HAPError PWMSet(size_t channel, uint16_t level) {
+  int pin;
+  if (!Pin(channel, &pin)) {
+    return kHAPError_InvalidState;
+  }
+  return (PWMSetPin(pin, level) ? kHAPError_None : kHAPError_Unknown);
+}
+
+/**
+ * Port state of the expander. All 8 bits are written on every change.
+ */
+static uint8_t pcf8574Port;
+
+static bool PCF8574Write(void) {
+  struct mgos_i2c *i2c = mgos_i2c_get_global();
+  uint16_t addr = (uint16_t) mgos_sys_config_get_app_output_i2c_addr();
+  return i2c != NULL && mgos_i2c_write(i2c, addr, &pcf8574Port, 1, true);
+}
+
+static bool PCF8574Init(void) {
+  pcf8574Port = (mgos_sys_config_get_app_output_active_low() ? 0xFF : 0x00);
+  return PCF8574Write();
+}
+
+static HAPError PCF8574Set(size_t channel, uint16_t level) {
+  int bit;
+  if (!Pin(channel, &bit) || bit < 0 || bit > 7) {
+    return kHAPError_InvalidState;
+  }
+  if ((level != 0) != mgos_sys_config_get_app_output_active_low()) {
+    pcf8574Port |= (uint8_t)(1U << bit);
+  } else {
+    pcf8574Port &= (uint8_t) ~(1U << bit);
+  }
+  return (PCF8574Write() ? kHAPError_None : kHAPError_Unknown);
+}
+
+static const OutputDriver hardwareDrivers[] = {
+    {.name = "gpio", .init = GPIOInit, .set = GPIOSet},
+    {.name = "pwm", .init = PWMInit, .set = PWMSet},
+    {.name = "pcf8574", .init = PCF8574Init, .set = PCF8574Set},
+};
+#endif
+
+static const OutputDriver *FindDriver(const char *name) {
+#if APP_OUTPUT_HW
+  for (size_t i = 0; i < HAPArrayCount(hardwareDrivers); i++) {
+    if (strcmp(hardwareDrivers[i].name, name) == 0) {
+      return &hardwareDrivers[i];
+    }
+  }
+#endif
+  if (strcmp(name, simDriver.name) != 0) {
+    LOG(LL_ERROR, ("Unknown output driver %s, using sim", name));
+  }
+  return &simDriver;
+}
+
+/**
+ * Parse app.output.pins, a comma-separated list.
+ */
+static void ParsePins(const char *_Nullable pins) {
+  output.numPins = 0;
+  while (pins != NULL && *pins != '\0' && output.numPins < kOutput_MaxPins) {
+    char *end;
+    long pin = strtol(pins, &end, 0);
+    if (end == pins) break;
+    output.pins[output.numPins++] = (int) pin;
+    pins = (*end == ',' ? end + 1 : end);
+  }
+}
+
+/**
+ * Run the driver for a command. Unchanged levels are not written to the
+ * hardware. Driver side: the output task, or the main loop without one.
+ */
+static void OutputApply(const OutputCommand *cmd, OutputResult *result) {
+  *result = (OutputResult){.command = *cmd, .err = kHAPError_None};
+  if (output.levels[cmd->channel] != cmd->level) {
+    result->err = output.driver->set(cmd->channel, cmd->level);
+    result->changed = (result->err == kHAPError_None);
+    if (result->changed) {
+      output.levels[cmd->channel] = cmd->level;
+    }
+  }
+  result->appliedUs = mgos_uptime_micros();
+}
+
+/**
+ * Account for an applied command and report it. Main loop.
+ */
+static void OutputApplied(const OutputResult *result) {
+  const OutputCommand *cmd = &result->command;
+  if (result->changed) {
+    output.changedUs[cmd->channel] = result->appliedUs;
+  }
+  if (result->err == kHAPError_None) {
+    MetricsRecordDuration(kMetricsHistogram_Output,
+                          result->appliedUs - cmd->queuedUs);
+  }
+  output.applied(cmd->id, result->err);
+}
+
+#if APP_OUTPUT_TASK
+static void OutputResultsCallback(void *arg HAP_UNUSED) {
+  output.resultsScheduled = false;
+  OutputResult result;
+  while (SPSCQueuePop(&output.results, &result)) {
+    OutputApplied(&result);
+  }
+}
+#endif
+
+#if !APP_OUTPUT_TASK
+static void OutputDrainCallback(void *arg HAP_UNUSED);
+#endif
+
+/**
+ * Apply all queued commands, each no earlier than delayUs after it was
+ * queued. Driver side.
+ */
+static void OutputDrain(void) {
+  output.drainScheduled = false;
+  OutputCommand cmd;
+  while (SPSCQueuePeek(&output.queue, &cmd)) {
+    int64_t waitUs = cmd.queuedUs + output.delayUs - mgos_uptime_micros();
+    if (waitUs > 0) {
+#if APP_OUTPUT_TASK
+      vTaskDelay(pdMS_TO_TICKS(waitUs / 1000) + 1);
+      continue;
+#else
+      output.drainScheduled = true;
+      mgos_set_timer((int) (waitUs / 1000) + 1, 0, OutputDrainCallback, NULL);
+      return;
+#endif
+    }
+    (void) SPSCQueuePop(&output.queue, &cmd);
+    OutputResult result;
+    OutputApply(&cmd, &result);
+#if APP_OUTPUT_TASK
+    // The results queue is as long as the command queue, so it is only full
+    // while the main loop is busy. Wait for it rather than lose an outcome.
+    while (!SPSCQueuePush(&output.results, &result)) {
+      vTaskDelay(1);
+    }
+    if (!output.resultsScheduled) {
+      output.resultsScheduled = true;
+      mgos_invoke_cb(OutputResultsCallback, NULL, false);
+    }
+#else
+    OutputApplied(&result);
+#endif
+  }
+}
+
+#if APP_OUTPUT_TASK
+static void OutputTask(void *arg HAP_UNUSED) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    OutputDrain();
+  }
+}
+#else
+static void OutputDrainCallback(void *arg HAP_UNUSED) {
+  OutputDrain();
+}
+#endif
+
+bool OutputSet(size_t channel, uint16_t level, AsyncWriteID id) {
+  HAPPrecondition(channel < output.numChannels);
+
+  OutputCommand cmd = {.channel = (uint16_t) channel,
+                       .level = level,
+                       .id = id,
+                       .queuedUs = mgos_uptime_micros()};
+  if (!SPSCQueuePush(&output.queue, &cmd)) {
+    return false;
+  }
+  if (!output.drainScheduled) {
+    output.drainScheduled = true;
+#if APP_OUTPUT_TASK
+    xTaskNotifyGive(output.task);
+#else
+    mgos_invoke_cb(OutputDrainCallback, NULL, false);
+#endif
+  }
+  return true;
+}
+
+uint16_t OutputGetLevel(size_t channel) {
+  HAPPrecondition(channel < output.numChannels);
+
+  return output.levels[channel];
+}
+
+static int OutputPrintChannels(struct json_out *out, va_list *ap HAP_UNUSED) {
+  int len = json_printf(out, "[");
+  for (size_t i = 0; i < output.numChannels; i++) {
+    len += json_printf(out, "%s{level: %u, changed: %.3lf}",
+                       (i == 0 ? "" : ", "), (unsigned) output.levels[i],
+                       output.changedUs[i] / 1000000.0);
+  }
+  return len + json_printf(out, "]");
+}
+
+/**
+ * App.Outputs RPC: driver, queue state and the level and time of the last
+ * change of each channel.
+ */
+static void OutputRPCHandler(struct mg_rpc_request_info *ri,
+                             void *cb_arg HAP_UNUSED,
+                             struct mg_rpc_frame_info *fi HAP_UNUSED,
+                             struct mg_str args HAP_UNUSED) {
+  mg_rpc_send_responsef(
+      ri, "{driver: %Q, queued: %u, dropped: %u, channels: %M}",
+      output.driver->name, (unsigned) SPSCQueueGetCount(&output.queue),
+      (unsigned) output.queue.numDropped, OutputPrintChannels);
+}
+
+void OutputInit(size_t numChannels, OutputAppliedCallback applied) {
+  HAPPrecondition(applied);
+
+  output.applied = applied;
+  output.numChannels = numChannels;
+  output.levels = calloc(numChannels, sizeof *output.levels);
+  output.changedUs = calloc(numChannels, sizeof *output.changedUs);
+  // A transition frame queues a command for every moving channel.
+  size_t queueSize = kOutput_MinQueueSize;
+  while (queueSize < numChannels) {
+    queueSize *= 2;
+  }
+  output.commands = calloc(queueSize, sizeof *output.commands);
+  HAPAssert(output.levels && output.changedUs && output.commands);
+  SPSCQueueInit(&output.queue, output.commands, sizeof output.commands[0],
+                queueSize);
+#if APP_OUTPUT_TASK
+  output.resultBuffer = calloc(queueSize, sizeof *output.resultBuffer);
+  HAPAssert(output.resultBuffer);
+  SPSCQueueInit(&output.results, output.resultBuffer,
+                sizeof output.resultBuffer[0], queueSize);
+#endif
+
+  ParsePins(mgos_sys_config_get_app_output_pins());
+  output.driver = FindDriver(mgos_sys_config_get_app_output_type());
+  if (output.driver->init != NULL && !output.driver->init()) {
+    LOG(LL_ERROR, ("Output driver %s failed to initialize, using sim",
+                   output.driver->name));
+    output.driver = &simDriver;
+  }
+  if (output.driver != &simDriver && output.numPins < numChannels) {
+    LOG(LL_ERROR, ("%u output channels but only %u pins",
+                   (unsigned) numChannels, (unsigned) output.numPins));
+  }
+  if (output.driver == &simDriver) {
+    output.delayUs =
+        (int64_t) mgos_sys_config_get_app_actuator_delay_ms() * 1000;
+  }
+  LOG(LL_INFO, ("Outputs: %u channels, driver %s", (unsigned) numChannels,
+                output.driver->name));
+#if APP_OUTPUT_TASK
+  // Same priority as the main loop: a driver waiting for the bus blocks,
+  // which lets the main loop run.
+  BaseType_t created = xTaskCreate(OutputTask, "output", kOutput_TaskStackSize,
+                                   NULL, uxTaskPriorityGet(NULL), &output.task);
+  HAPAssert(created == pdPASS);
+#endif
+
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.Outputs", "",
+                     OutputRPCHandler, NULL);
+}
@@ -0,0 +1,81 @@
+// Light outputs.
+//
+// Drives app.output.channels_per_light output channels per light through the
+// driver selected by app.output.type:
+//
+//   sim      No hardware. Records the level and the time of each change
+//            ("virtual GPIO"), optionally applying each command
+//            app.actuator_delay_ms after it was queued, fade frames
+//            included. The only driver on the host build.
+//   gpio     Relay or LED on a GPIO pin, on for any nonzero level.
+//   pwm      Dimmable output on a PWM pin.
+//   pcf8574  Relay on a bit of a PCF8574 I2C port expander.
+//
+// Nothing on the main loop calls the driver: OutputSet pushes a command onto
+// a bounded queue and returns, and fails instead of waiting when the queue is
+// full. Changes and transition frames (Transition.h) both go through it. The
+// outcome of each command is reported back on the main loop. The time from
+// OutputSet to the output changing is recorded in the output_us histogram
+// (App.Metrics).
+//
+// With the APP_OUTPUT_TASK cdef (set for ESP32 in mos.yml) a FreeRTOS task
+// drains the queue and runs the driver, and hands the outcomes back to the
+// main loop on a second queue. A driver that waits for the hardware (pcf8574
+// waits for each I2C write) then blocks only that task. Without it (ESP8266,
+// which has no tasks for the app, and the host build) the queue is drained
+// on the main loop after the current request, and a slow driver holds up
+// the accessory server for as long as it takes.
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "AsyncWrite.h"
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Level of a fully on output.
+ */
+#define kOutput_LevelMax ((uint16_t) 0xFFFF)
+
+/**
+ * Called on the main loop for every queued command once the driver has run,
+ * with the id passed to OutputSet and the error of the driver.
+ */
+typedef void (*OutputAppliedCallback)(AsyncWriteID id, HAPError err);
+
+/**
+ * Set up the driver for a number of channels, with a queue that holds at
+ * least one command per channel, and register the App.Outputs RPC method.
+ */
+void OutputInit(size_t numChannels, OutputAppliedCallback applied);
+
+/**
+ * Queue a level change.
+ *
+ * @return false if the queue is full; applied is not called in that case.
+ */
+HAP_RESULT_USE_CHECK
+bool OutputSet(size_t channel, uint16_t level, AsyncWriteID id);
+
+/**
+ * Level last applied to a channel by the driver.
+ */
+uint16_t OutputGetLevel(size_t channel);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
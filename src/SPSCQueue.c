@@ -0,0 +1,60 @@
+// Bounded single-producer single-consumer queue.
+
+#include "SPSCQueue.h"
+
+#include "mgos.h"
+
+void SPSCQueueInit(SPSCQueue *queue, void *buffer, size_t elementSize,
+                   size_t capacity) {
+  HAPPrecondition(queue);
+  HAPPrecondition(buffer);
+  HAPPrecondition(elementSize > 0);
+  HAPPrecondition(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+  HAPRawBufferZero(queue, sizeof *queue);
+  queue->buffer = buffer;
+  queue->elementSize = elementSize;
+  queue->mask = (uint32_t)(capacity - 1);
+}
+
+IRAM bool SPSCQueuePush(SPSCQueue *queue, const void *element) {
+  uint32_t head = queue->head;
+  uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  if (head - tail > queue->mask) {
+    queue->numDropped++;
+    return false;
+  }
+  // Byte copy: memcpy may not be in IRAM.
+  uint8_t *dst = &queue->buffer[(head & queue->mask) * queue->elementSize];
+  const uint8_t *src = element;
+  for (size_t i = 0; i < queue->elementSize; i++) {
+    dst[i] = src[i];
+  }
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool SPSCQueuePeek(const SPSCQueue *queue, void *element) {
+  uint32_t tail = queue->tail;
+  uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return false;
+  }
+  const uint8_t *src =
+      &queue->buffer[(tail & queue->mask) * queue->elementSize];
+  HAPRawBufferCopyBytes(element, src, queue->elementSize);
+  return true;
+}
+
+bool SPSCQueuePop(SPSCQueue *queue, void *element) {
+  if (!SPSCQueuePeek(queue, element)) {
+    return false;
+  }
+  __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+size_t SPSCQueueGetCount(const SPSCQueue *queue) {
+  return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
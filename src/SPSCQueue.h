@@ -0,0 +1,71 @@
+// Bounded single-producer single-consumer queue.
+//
+// Lock-free ring buffer of fixed-size elements: the producer only writes the
+// head index and the consumer only writes the tail index, so one side may be
+// an interrupt handler or another task. Push never blocks: it fails when the
+// queue is full.
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+typedef struct {
+  uint8_t *buffer;
+  size_t elementSize;
+  uint32_t mask;  // Capacity - 1.
+  uint32_t head;  // Next slot to push, written by the producer.
+  uint32_t tail;  // Next slot to pop, written by the consumer.
+  uint32_t numDropped;  // Pushes that found the queue full.
+} SPSCQueue;
+
+/**
+ * Initialize a queue over a buffer of capacity elements. The capacity must
+ * be a power of 2.
+ */
+void SPSCQueueInit(SPSCQueue *queue, void *buffer, size_t elementSize,
+                   size_t capacity);
+
+/**
+ * Append an element. Safe to call from an interrupt handler.
+ *
+ * @return false if the queue is full.
+ */
+bool SPSCQueuePush(SPSCQueue *queue, const void *element);
+
+/**
+ * Remove the oldest element.
+ *
+ * @return false if the queue is empty.
+ */
+bool SPSCQueuePop(SPSCQueue *queue, void *element);
+
+/**
+ * Copy the oldest element without removing it.
+ *
+ * @return false if the queue is empty.
+ */
+bool SPSCQueuePeek(const SPSCQueue *queue, void *element);
+
+/**
+ * Number of elements queued.
+ */
+size_t SPSCQueueGetCount(const SPSCQueue *queue);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,255 @@
+// Session registry.
+
+#include "SessionRegistry.h"
+
+#include "HAP+Internal.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+/**
+ * The accessory server stores a pairing as one record per pairing slot in
+ * kSDKKeyValueStoreDomain_Pairings, laid out as in HAPPairing: the pairing
+ * identifier (zero padded), the number of identifier bytes, the long-term
+ * public key and the permissions.
+ */
+#define kSessionRegistry_PairingRecordBytes                               \
+  (sizeof(HAPPairingID) + sizeof(uint8_t) + sizeof(HAPPairingPublicKey) + \
+   sizeof(uint8_t))
+
+typedef struct {
+  HAPSessionRef *_Nullable session;
+  int64_t openedUs;
+  int pairingID;  // -1 until the session is verified.
+  uint32_t setupMs;  // Accept to first request, dominated by pair-verify.
+  uint32_t numRequests;
+  uint32_t handlerUs;
+  uint32_t maxHandlerUs;
+} SessionEntry;
+
+typedef struct {
+  // Controller the totals belong to, as of the last report; 0 bytes until
+  // then.
+  HAPPairingID identifier;
+  uint8_t numIdentifierBytes;
+  uint32_t numSessions;
+  uint32_t numRequests;
+  uint32_t totalSetupMs;
+  uint32_t maxSetupMs;
+  int64_t lastSeenUs;
+} ControllerEntry;
+
+static struct {
+  HAPPlatformKeyValueStoreRef _Nullable keyValueStore;
+  SessionEntry sessions[kSessionRegistry_MaxSessions];
+  ControllerEntry controllers[kSessionRegistry_MaxControllers];
+  size_t numActive;
+  uint32_t numAccepted;
+  uint32_t numUntracked;
+} registry;
+
+static SessionEntry *_Nullable FindSession(const HAPSessionRef *session) {
+  for (size_t i = 0; i < kSessionRegistry_MaxSessions; i++) {
+    if (registry.sessions[i].session == session) {
+      return &registry.sessions[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Pairing slot of a verified session.
+ *
+ * The ADK has no public accessor for the controller of a session, so this
+ * is the one place that reads the session internals. Only the slot comes
+ * from there; the controller is identified by its pairing (GetController).
+ */
+static int GetPairingID(const HAPSessionRef *session) {
+  return ((const HAPSession *) session)->hap.pairingID;
+}
+
+/**
+ * Get the totals of the controller paired in a slot.
+ *
+ * @return NULL if the slot is out of range.
+ */
+static ControllerEntry *_Nullable GetController(int pairingID) {
+  if (pairingID < 0 ||
+      (size_t) pairingID >= kSessionRegistry_MaxControllers) {
+    return NULL;
+  }
+  return &registry.controllers[pairingID];
+}
+
+/**
+ * Check the totals of a slot against the pairing it holds now. A slot is
+ * reused once its pairing is removed, so the totals are tagged with the
+ * pairing identifier and start over when it changes.
+ *
+ * This reads the key-value store, so it is only done when the totals are
+ * reported, never on the request path. Sessions of a new controller in a
+ * reused slot count towards the old one until the next report.
+ *
+ * @return false if the slot holds no pairing (any more).
+ */
+static bool ResolveController(size_t pairingID) {
+  ControllerEntry *c = &registry.controllers[pairingID];
+  uint8_t record[kSessionRegistry_PairingRecordBytes];
+  size_t numBytes;
+  bool found;
+  HAPError err = HAPPlatformKeyValueStoreGet(
+      HAPNonnull(registry.keyValueStore), kSDKKeyValueStoreDomain_Pairings,
+      (HAPPlatformKeyValueStoreKey) pairingID, record, sizeof record,
+      &numBytes, &found);
+  if (err || !found || numBytes != sizeof record) {
+    HAPRawBufferZero(c, sizeof *c);  // Pairing removed.
+    return false;
+  }
+  uint8_t numIdentifierBytes = record[sizeof(HAPPairingID)];
+  if (numIdentifierBytes == 0 || numIdentifierBytes > sizeof(HAPPairingID)) {
+    HAPRawBufferZero(c, sizeof *c);
+    return false;
+  }
+  if (c->numIdentifierBytes == 0) {
+    HAPRawBufferCopyBytes(&c->identifier, record, numIdentifierBytes);
+    c->numIdentifierBytes = numIdentifierBytes;
+  } else if (c->numIdentifierBytes != numIdentifierBytes ||
+             !HAPRawBufferAreEqual(&c->identifier, record,
+                                   numIdentifierBytes)) {
+    HAPRawBufferZero(c, sizeof *c);  // Another controller took the slot.
+    HAPRawBufferCopyBytes(&c->identifier, record, numIdentifierBytes);
+    c->numIdentifierBytes = numIdentifierBytes;
+  }
+  return true;
+}
+
+void SessionRegistryAccept(HAPSessionRef *session) {
+  HAPPrecondition(session);
+
+  registry.numAccepted++;
+  SessionEntry *e = FindSession(NULL);
+  if (e == NULL) {
+    registry.numUntracked++;
+    return;
+  }
+  HAPRawBufferZero(e, sizeof *e);
+  e->session = session;
+  e->openedUs = mgos_uptime_micros();
+  e->pairingID = -1;
+  registry.numActive++;
+}
+
+void SessionRegistryInvalidate(HAPSessionRef *session) {
+  HAPPrecondition(session);
+
+  SessionEntry *e = FindSession(session);
+  if (e == NULL) {
+    return;
+  }
+  ControllerEntry *c = GetController(e->pairingID);
+  if (c != NULL) {
+    c->numRequests += e->numRequests;
+    c->lastSeenUs = mgos_uptime_micros();
+  }
+  e->session = NULL;
+  registry.numActive--;
+}
+
+void SessionRegistryRecordRequest(HAPSessionRef *session, int64_t startUs) {
+  HAPPrecondition(session);
+
+  SessionEntry *e = FindSession(session);
+  if (e == NULL) {
+    return;
+  }
+  uint32_t us = (uint32_t)(mgos_uptime_micros() - startUs);
+  e->numRequests++;
+  e->handlerUs += us;
+  if (us > e->maxHandlerUs) e->maxHandlerUs = us;
+  if (e->pairingID < 0) {
+    // Requests only arrive on verified sessions, so the pairing is known now.
+    e->pairingID = GetPairingID(session);
+    e->setupMs = (uint32_t)((startUs - e->openedUs) / 1000);
+    ControllerEntry *c = GetController(e->pairingID);
+    if (c != NULL) {
+      c->numSessions++;
+      c->totalSetupMs += e->setupMs;
+      if (e->setupMs > c->maxSetupMs) c->maxSetupMs = e->setupMs;
+    }
+  }
+}
+
+size_t SessionRegistryGetNumActive(void) {
+  return registry.numActive;
+}
+
+static int SessionRegistryPrintSessions(struct json_out *out,
+                                        va_list *ap HAP_UNUSED) {
+  int64_t nowUs = mgos_uptime_micros();
+  bool first = true;
+  int len = json_printf(out, "[");
+  for (size_t i = 0; i < kSessionRegistry_MaxSessions; i++) {
+    const SessionEntry *e = &registry.sessions[i];
+    if (e->session == NULL) continue;
+    len += json_printf(
+        out,
+        "%s{slot: %u, pairing: %d, age_ms: %u, setup_ms: %u, requests: %u, "
+        "handler_us: %u, max_handler_us: %u}",
+        (first ? "" : ", "), (unsigned) i, e->pairingID,
+        (unsigned) ((nowUs - e->openedUs) / 1000), (unsigned) e->setupMs,
+        (unsigned) e->numRequests,
+        (unsigned) e->handlerUs, (unsigned) e->maxHandlerUs);
+    first = false;
+  }
+  return len + json_printf(out, "]");
+}
+
+static int SessionRegistryPrintControllers(struct json_out *out,
+                                           va_list *ap HAP_UNUSED) {
+  int64_t nowUs = mgos_uptime_micros();
+  bool first = true;
+  int len = json_printf(out, "[");
+  for (size_t i = 0; i < kSessionRegistry_MaxControllers; i++) {
+    const ControllerEntry *c = &registry.controllers[i];
+    if (c->numSessions == 0 || !ResolveController(i) ||
+        c->numSessions == 0) {
+      continue;
+    }
+    len += json_printf(
+        out,
+        "%s{pairing: %u, controller: %.*Q, sessions: %u, requests: %u, "
+        "avg_setup_ms: %u, max_setup_ms: %u, last_seen_s: %d}",
+        (first ? "" : ", "), (unsigned) i, (int) c->numIdentifierBytes,
+        (const char *) c->identifier.bytes, (unsigned) c->numSessions,
+        (unsigned) c->numRequests,
+        (unsigned) (c->totalSetupMs / c->numSessions),
+        (unsigned) c->maxSetupMs,
+        (int) (c->lastSeenUs > 0 ? (nowUs - c->lastSeenUs) / 1000000 : -1));
+    first = false;
+  }
+  return len + json_printf(out, "]");
+}
+
+/**
+ * App.Sessions RPC: returns open sessions and per-controller totals.
+ */
+static void SessionRegistryRPCHandler(struct mg_rpc_request_info *ri,
+                                      void *cb_arg HAP_UNUSED,
+                                      struct mg_rpc_frame_info *fi HAP_UNUSED,
+                                      struct mg_str args HAP_UNUSED) {
+  mg_rpc_send_responsef(
+      ri,
+      "{accepted: %u, active: %u, untracked: %u, sessions: %M, "
+      "controllers: %M}",
+      (unsigned) registry.numAccepted, (unsigned) registry.numActive,
+      (unsigned) registry.numUntracked, SessionRegistryPrintSessions,
+      SessionRegistryPrintControllers);
+}
+
+void SessionRegistryInit(HAPPlatformKeyValueStoreRef keyValueStore) {
+  HAPPrecondition(keyValueStore);
+
+  registry.keyValueStore = keyValueStore;
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.Sessions", "",
+                     SessionRegistryRPCHandler, NULL);
+}
@@ -0,0 +1,73 @@
+// Session registry.
+//
+// Tracks every open HAP session from accept to invalidate in a fixed table:
+// when it was opened, which controller (pairing) it belongs to, how long it
+// took from accept to the first request (i.e. the cost of pair-verify),
+// how many requests it made and how long the handlers took. Totals are also
+// kept per controller, identified by its pairing identifier, so the one
+// causing a reconnect storm stands out; they are dropped when the pairing is
+// found removed. Reported by the App.Sessions RPC method, which is also when
+// the pairings are looked up.
+
+#ifndef SESSION_REGISTRY_H
+#define SESSION_REGISTRY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Maximum number of concurrent sessions tracked.
+ */
+#define kSessionRegistry_MaxSessions ((size_t) 32)
+
+/**
+ * Maximum number of controllers tracked. Matches the pairing storage size.
+ */
+#define kSessionRegistry_MaxControllers \
+  ((size_t) kHAPPairingStorage_MinElements)
+
+/**
+ * Register a newly accepted session.
+ */
+void SessionRegistryAccept(HAPSessionRef *session);
+
+/**
+ * Remove an invalidated session, folding its totals into its controller.
+ */
+void SessionRegistryInvalidate(HAPSessionRef *session);
+
+/**
+ * Account a handled request. startUs is the handler start time from
+ * MetricsNow.
+ */
+void SessionRegistryRecordRequest(HAPSessionRef *session, int64_t startUs);
+
+/**
+ * Number of sessions currently open.
+ */
+size_t SessionRegistryGetNumActive(void);
+
+/**
+ * Register the App.Sessions RPC method.
+ *
+ * @param keyValueStore  Key-value store of the accessory server, where the
+ *                       pairings are looked up.
+ */
+void SessionRegistryInit(HAPPlatformKeyValueStoreRef keyValueStore);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+// Lightweight binary event trace.
+
+#include "Trace.h"
+
+#include "mgos.h"
+
+#if APP_TRACE
+
+#include "mgos_rpc.h"
+
+HAP_STATIC_ASSERT((APP_TRACE_NUM_EVENTS & (APP_TRACE_NUM_EVENTS - 1)) == 0,
+                  APP_TRACE_NUM_EVENTS_not_power_of_2);
+
+typedef struct {
+  uint32_t timestampUs;  // Low 32 bits of uptime, microseconds.
+  uint16_t id;
+  uint16_t payload;
+} TraceEntry;
+
+static struct {
+  TraceEntry entries[APP_TRACE_NUM_EVENTS];
+  uint32_t head;  // Total number of events recorded.
+  uint32_t tail;  // Total number of events drained or overwritten.
+  uint32_t numDropped;
+} trace;
+
+void TraceRecord(TraceEvent id, uint16_t payload) {
+  TraceEntry *e = &trace.entries[trace.head & (APP_TRACE_NUM_EVENTS - 1)];
+  e->timestampUs = (uint32_t) mgos_uptime_micros();
+  e->id = (uint16_t) id;
+  e->payload = payload;
+  trace.head++;
+  if (trace.head - trace.tail > APP_TRACE_NUM_EVENTS) {
+    trace.tail++;
+    trace.numDropped++;
+  }
+}
+
+static int TracePrintEvents(struct json_out *out, va_list *ap HAP_UNUSED) {
+  int len = 0;
+  len += json_printf(out, "[");
+  for (bool first = true; trace.tail != trace.head; first = false) {
+    const TraceEntry *e =
+        &trace.entries[trace.tail & (APP_TRACE_NUM_EVENTS - 1)];
+    len += json_printf(out, "%s[%u,%u,%u]", (first ? "" : ","),
+                       (unsigned) e->timestampUs, (unsigned) e->id,
+                       (unsigned) e->payload);
+    trace.tail++;
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+/**
+ * App.Trace RPC: returns and clears buffered events as [ts_us, id, payload].
+ */
+static void TraceRPCHandler(struct mg_rpc_request_info *ri,
+                            void *cb_arg HAP_UNUSED,
+                            struct mg_rpc_frame_info *fi HAP_UNUSED,
+                            struct mg_str args HAP_UNUSED) {
+  uint32_t numDropped = trace.numDropped;
+  trace.numDropped = 0;
+  mg_rpc_send_responsef(ri, "{dropped: %u, events: %M}", (unsigned) numDropped,
+                        TracePrintEvents);
+}
+
+void TraceInit(void) {
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.Trace", "", TraceRPCHandler,
+                     NULL);
+}
+
+#else
+
+void TraceInit(void) {
+}
+
+#endif
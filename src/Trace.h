@@ -0,0 +1,69 @@
+// Lightweight binary event trace.
+//
+// Hot paths record a fixed-size event (id, timestamp, 16-bit payload) into a
+// RAM ring buffer instead of formatting a log line. The buffer is drained over
+// RPC (App.Trace) when somebody asks for it. With the APP_TRACE cdef set to 0
+// the TRACE() macro compiles to nothing.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+#ifndef APP_TRACE
+#define APP_TRACE 0
+#endif
+
+/**
+ * Number of events kept in the ring buffer. Must be a power of 2.
+ */
+#ifndef APP_TRACE_NUM_EVENTS
+#define APP_TRACE_NUM_EVENTS 128
+#endif
+
+/**
+ * Trace event ids.
+ */
+typedef enum {
+  kTraceEvent_LightBulbOnRead = 1,
+  kTraceEvent_LightBulbOnWrite,
+  kTraceEvent_ButtonPress,  // Payload: ButtonPress.
+} TraceEvent;
+
+#if APP_TRACE
+
+/**
+ * Record an event. Must be called from the main loop.
+ */
+void TraceRecord(TraceEvent id, uint16_t payload);
+
+#define TRACE(id, payload) TraceRecord((id), (uint16_t)(payload))
+
+#else
+
+#define TRACE(id, payload) ((void) 0)
+
+#endif
+
+/**
+ * Register the App.Trace RPC method. No-op if tracing is disabled.
+ */
+void TraceInit(void);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+// Light transitions.
+
+#include "Transition.h"
+#include "Color.h"
+#include "Output.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+/**
+ * Upper bound of channels times frames of one App.TransitionBench run, which
+ * blocks the main loop while it runs.
+ */
+#define kTransition_MaxBenchSteps ((uint32_t) 1000000)
+
+/**
+ * Highest frame rate; the frame timer has millisecond resolution.
+ */
+#define kTransition_MaxFPS 100
+
+/**
+ * A change with a write to complete.
+ */
+typedef struct {
+  AsyncWriteID id;           // 0: free.
+  uint32_t numChannelsLeft;  // Channels whose final level is not queued yet.
+  uint32_t numPending;       // Commands queued and not applied yet.
+  HAPError status;           // First error of a command.
+} TransitionChange;
+
+typedef struct {
+  uint32_t level;  // Perceived level, 16.8 fixed point.
+  int32_t step;    // Added per frame.
+  uint16_t target;
+  uint16_t numFramesLeft;
+  AsyncWriteID id;  // Change of the frames, until the final one is queued.
+  uint8_t change;   // Index of that change, if still tracked.
+} TransitionChannel;
+
+static struct {
+  TransitionChannel *channels;
+  size_t numChannels;
+  TransitionChange changes[kAsyncWrite_MaxPending];
+  mgos_timer_id timer;
+  TransitionStats stats;
+} transition;
+
+/**
+ * Sink for the benchmark results, so that the compiler keeps the work.
+ */
+static volatile uint32_t transitionBenchSink;
+
+/**
+ * Advance a moving channel by one frame.
+ *
+ * @return Perceived level for this frame.
+ */
+static inline uint16_t TransitionStep(TransitionChannel *ch) {
+  if (--ch->numFramesLeft == 0) {
+    ch->level = (uint32_t) ch->target << 8;
+  } else {
+    ch->level += (uint32_t) ch->step;
+  }
+  return (uint16_t)(ch->level >> 8);
+}
+
+static TransitionChange *_Nullable FindChange(AsyncWriteID id) {
+  for (size_t i = 0; i < HAPArrayCount(transition.changes); i++) {
+    if (transition.changes[i].id == id) {
+      return &transition.changes[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Get the change a channel is moving for, unless it has been superseded.
+ */
+static TransitionChange *_Nullable ChannelChange(const TransitionChannel *ch) {
+  if (ch->id == 0 || transition.changes[ch->change].id != ch->id) {
+    return NULL;
+  }
+  return &transition.changes[ch->change];
+}
+
+/**
+ * Complete the write of a change once all of its levels have been applied.
+ */
+static void CheckChangeDone(TransitionChange *change) {
+  if (change->numChannelsLeft != 0 || change->numPending != 0) {
+    return;
+  }
+  TransitionChange done = *change;
+  HAPRawBufferZero(change, sizeof *change);
+  AsyncWriteComplete(done.id, done.status);
+}
+
+static void TransitionApplied(AsyncWriteID id, HAPError err) {
+  TransitionChange *change = (id != 0 ? FindChange(id) : NULL);
+  if (change == NULL) {
+    return;  // Superseded.
+  }
+  if (err != kHAPError_None && change->status == kHAPError_None) {
+    change->status = err;
+  }
+  change->numPending--;
+  CheckChangeDone(change);
+}
+
+/**
+ * Queue a perceived level for a channel.
+ *
+ * @return false if the queue is full.
+ */
+static bool QueueLevel(size_t channel, uint16_t level,
+                       TransitionChange *_Nullable change) {
+  if (!OutputSet(channel, ColorGamma(level), (change ? change->id : 0))) {
+    return false;
+  }
+  if (change) {
+    change->numPending++;
+  }
+  return true;
+}
+
+static void TransitionFrameCallback(void *arg HAP_UNUSED) {
+  int64_t startUs = mgos_uptime_micros();
+  size_t numStepped = 0;
+  bool moving = false;
+  for (size_t i = 0; i < transition.numChannels; i++) {
+    TransitionChannel *ch = &transition.channels[i];
+    if (ch->numFramesLeft == 0) {
+      continue;
+    }
+    TransitionChange *change = ChannelChange(ch);
+    if (!QueueLevel(i, TransitionStep(ch), change)) {
+      if (ch->numFramesLeft == 0) {
+        ch->numFramesLeft = 1;  // Queue full: retry the final level.
+      }
+    } else if (ch->numFramesLeft == 0 && change) {
+      ch->id = 0;
+      change->numChannelsLeft--;
+    }
+    moving |= (ch->numFramesLeft != 0);
+    numStepped++;
+  }
+  uint32_t us = (uint32_t)(mgos_uptime_micros() - startUs);
+  transition.stats.numFrames++;
+  transition.stats.numChannelFrames += numStepped;
+  transition.stats.busyUs += us;
+  if (us > transition.stats.maxFrameUs) {
+    transition.stats.maxFrameUs = us;
+  }
+  if (!moving) {
+    mgos_clear_timer(transition.timer);
+    transition.timer = MGOS_INVALID_TIMER_ID;
+  }
+}
+
+void TransitionStart(size_t channel, const uint16_t *levels, size_t numLevels,
+                     AsyncWriteID id) {
+  HAPPrecondition(levels);
+  HAPPrecondition(numLevels > 0);
+  HAPPrecondition(channel + numLevels <= transition.numChannels);
+
+  int fps = mgos_sys_config_get_app_transition_fps();
+  if (fps > kTransition_MaxFPS) fps = kTransition_MaxFPS;
+  int durationMs = mgos_sys_config_get_app_transition_ms();
+  uint32_t numFrames = 0;
+  if (fps > 0 && durationMs > 0) {
+    numFrames = (uint32_t) durationMs * (uint32_t) fps / 1000;
+    if (numFrames > UINT16_MAX) numFrames = UINT16_MAX;
+  }
+  // Changes still moving these channels will not reach their levels.
+  for (size_t k = 0; k < numLevels; k++) {
+    TransitionChange *previous =
+        ChannelChange(&transition.channels[channel + k]);
+    if (previous) {
+      AsyncWriteID previousID = previous->id;
+      HAPRawBufferZero(previous, sizeof *previous);
+      AsyncWriteSupersede(previousID);
+    }
+  }
+  TransitionChange *change = NULL;
+  if (id != 0) {
+    change = FindChange(0);
+    if (change == NULL) {
+      AsyncWriteComplete(id, kHAPError_OutOfResources);
+    } else {
+      *change = (TransitionChange){.id = id};
+    }
+  }
+  for (size_t k = 0; k < numLevels; k++) {
+    TransitionChannel *ch = &transition.channels[channel + k];
+    ch->target = levels[k];
+    ch->id = 0;
+    if (numFrames <= 1) {
+      ch->level = (uint32_t) levels[k] << 8;
+      ch->numFramesLeft = 0;
+      if (!QueueLevel(channel + k, levels[k], change) && change &&
+          change->status == kHAPError_None) {
+        change->status = kHAPError_OutOfResources;
+      }
+      continue;
+    }
+    ch->step = (((int32_t) levels[k] << 8) - (int32_t) ch->level) /
+               (int32_t) numFrames;
+    ch->numFramesLeft = (uint16_t) numFrames;
+    if (change) {
+      ch->id = change->id;
+      ch->change = (uint8_t)(change - transition.changes);
+      change->numChannelsLeft++;
+    }
+  }
+  if (change) {
+    CheckChangeDone(change);
+  }
+  if (numFrames > 1 && transition.timer == MGOS_INVALID_TIMER_ID) {
+    transition.timer = mgos_set_timer(1000 / fps, MGOS_TIMER_REPEAT,
+                                      TransitionFrameCallback, NULL);
+  }
+}
+
+void TransitionGetStats(TransitionStats *stats) {
+  HAPPrecondition(stats);
+
+  *stats = transition.stats;
+}
+
+/**
+ * App.TransitionBench RPC: time the frame step (interpolation and gamma, no
+ * driver) over a number of channels that all fade for the whole run.
+ */
+static void TransitionBenchRPCHandler(struct mg_rpc_request_info *ri,
+                                      void *cb_arg HAP_UNUSED,
+                                      struct mg_rpc_frame_info *fi HAP_UNUSED,
+                                      struct mg_str args) {
+  int numChannels = 64, numFrames = 100;
+  json_scanf(args.p, args.len, ri->args_fmt, &numChannels, &numFrames);
+  if (numChannels < 1 || numFrames < 1 || numFrames >= UINT16_MAX ||
+      (uint32_t) numChannels * (uint32_t) numFrames >
+          kTransition_MaxBenchSteps) {
+    mg_rpc_send_errorf(ri, 400, "Need channels, frames >= 1, product <= %u",
+                       (unsigned) kTransition_MaxBenchSteps);
+    return;
+  }
+  TransitionChannel *channels = calloc((size_t) numChannels, sizeof *channels);
+  if (channels == NULL) {
+    mg_rpc_send_errorf(ri, 500, "Out of memory");
+    return;
+  }
+  for (int c = 0; c < numChannels; c++) {
+    channels[c].target = kOutput_LevelMax;
+    channels[c].step = ((int32_t) kOutput_LevelMax << 8) / (numFrames + 1);
+    channels[c].numFramesLeft = (uint16_t)(numFrames + 1);
+  }
+  uint32_t sum = 0;
+  int64_t startUs = mgos_uptime_micros();
+  for (int f = 0; f < numFrames; f++) {
+    for (int c = 0; c < numChannels; c++) {
+      sum += ColorGamma(TransitionStep(&channels[c]));
+    }
+  }
+  int64_t us = mgos_uptime_micros() - startUs;
+  transitionBenchSink = sum;
+  free(channels);
+  mg_rpc_send_responsef(
+      ri, "{channels: %d, frames: %d, us: %lld, ns_per_channel_frame: %.1lf}",
+      numChannels, numFrames, (long long) us,
+      us * 1000.0 / ((double) numChannels * numFrames));
+}
+
+void TransitionInit(size_t numChannels) {
+  OutputInit(numChannels, TransitionApplied);
+  transition.numChannels = numChannels;
+  transition.channels = calloc(numChannels, sizeof *transition.channels);
+  HAPAssert(transition.channels);
+  transition.timer = MGOS_INVALID_TIMER_ID;
+
+  mg_rpc_add_handler(mgos_rpc_get_global(), "App.TransitionBench",
+                     "{channels: %d, frames: %d}", TransitionBenchRPCHandler,
+                     NULL);
+}
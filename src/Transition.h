@@ -0,0 +1,79 @@
+// Light transitions.
+//
+// Fades output channels to new levels over app.transition.ms. One repeating
+// timer at app.transition.fps frames per second steps all moving channels
+// and runs only while a channel is moving. Levels are perceived levels,
+// interpolated in fixed point (16.8) so that a frame is an add per channel;
+// each frame level is gamma corrected (ColorGamma) and queued with
+// OutputSet, like a change without a fade time. A frame that does not fit
+// the queue is skipped, except for the final one, which is retried with the
+// next frame.
+//
+// The AsyncWrite of a change completes when the driver has applied the final
+// level of every channel, with the first error any of its commands met. A
+// change that another one replaces before its final levels are queued
+// completes right away with kAsyncWriteStatus_Superseded.
+//
+// Frame cost is reported by App.Metrics (transition: busy_us over
+// channel_frames is the cost per channel per frame, up to the queue; the
+// driver time is in output_us).
+// App.TransitionBench runs the interpolation and gamma step alone over a
+// scratch set of channels, to size the number of channels a device can fade.
+
+#ifndef TRANSITION_H
+#define TRANSITION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "AsyncWrite.h"
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Frame counters.
+ */
+typedef struct {
+  uint32_t numFrames;
+  uint32_t numChannelFrames;  // Channels stepped, summed over all frames.
+  uint32_t busyUs;            // Time spent in frames.
+  uint32_t maxFrameUs;
+} TransitionStats;
+
+/**
+ * Set up the channels, all at level 0, and their outputs (OutputInit), and
+ * register the App.TransitionBench RPC method.
+ */
+void TransitionInit(size_t numChannels);
+
+/**
+ * Move consecutive channels to new perceived levels, starting a fade from
+ * wherever they are, including the middle of another fade.
+ *
+ * @param channel    First channel.
+ * @param levels     Target level of each channel.
+ * @param numLevels  Number of channels.
+ * @param id         Completed when the change has been applied, or
+ *                   superseded; may be 0.
+ */
+void TransitionStart(size_t channel, const uint16_t *levels, size_t numLevels,
+                     AsyncWriteID id);
+
+/**
+ * Get frame counters.
+ */
+void TransitionGetStats(TransitionStats *stats);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+// Characteristic value cache.
+
+#include "ValueCache.h"
+#include "AttributeIndex.h"
+
+#include "mgos.h"
+
+/**
+ * A cached value. All supported formats fit in 32 bits.
+ */
+typedef struct {
+  uint32_t version;  // 0: never published.
+  union {
+    bool b;
+    uint8_t u8;
+    uint32_t u32;
+    int32_t i32;
+    float f;
+  } value;
+} CacheEntry;
+
+static struct {
+  CacheEntry *_Nullable entries;  // Per attribute index slot.
+  size_t numEntries;
+  uint32_t version;
+  ValueCacheStats stats;
+} cache;
+
+void ValueCacheCreate(void) {
+  ValueCacheRelease();
+
+  size_t n = AttributeIndexGetCount();
+  if (n == 0) {
+    return;
+  }
+  cache.entries = calloc(n, sizeof *cache.entries);
+  HAPAssert(cache.entries);
+  cache.numEntries = n;
+}
+
+void ValueCacheRelease(void) {
+  free(cache.entries);
+  cache.entries = NULL;
+  cache.numEntries = 0;
+}
+
+/**
+ * Find the cache slot of a characteristic and check its format against the
+ * hot record of the slot, which is returned in info.
+ *
+ * @return false if the cache has not been created (the accessory server was
+ *         not started, e.g. on an unprovisioned device).
+ */
+static bool FindSlot(const HAPAccessory *accessory,
+                     const HAPCharacteristic *characteristic,
+                     HAPCharacteristicFormat format, size_t *slot,
+                     AttributeIndexInfo *info) {
+  HAPPrecondition(accessory);
+  HAPPrecondition(characteristic);
+
+  if (cache.numEntries == 0) {
+    return false;
+  }
+  bool found =
+      AttributeIndexFindCharacteristic(accessory, characteristic, slot);
+  HAPPrecondition(found && *slot < cache.numEntries);
+  *info = AttributeIndexGetInfo(*slot);
+  HAPPrecondition(info->format == format);
+  return true;
+}
+
+/**
+ * Find the cache entry of a characteristic for publishing.
+ */
+static CacheEntry *_Nullable FindEntry(const HAPAccessory *accessory,
+                                       const HAPCharacteristic *characteristic,
+                                       HAPCharacteristicFormat format) {
+  size_t slot;
+  AttributeIndexInfo info;
+  if (!FindSlot(accessory, characteristic, format, &slot, &info)) {
+    return NULL;
+  }
+  return &cache.entries[slot];
+}
+
+void ValueCacheSetVolatile(const HAPAccessory *accessory,
+                           const HAPCharacteristic *characteristic,
+                           bool isVolatile) {
+  if (cache.numEntries == 0) {
+    return;
+  }
+  size_t slot;
+  bool found =
+      AttributeIndexFindCharacteristic(accessory, characteristic, &slot);
+  HAPPrecondition(found && slot < cache.numEntries);
+  AttributeIndexSetProperty(slot, kAttributeIndexProperty_Volatile,
+                            isVolatile);
+}
+
+uint32_t ValueCacheGetVersion(const HAPAccessory *accessory,
+                              const HAPCharacteristic *characteristic) {
+  size_t slot;
+  if (!AttributeIndexFindCharacteristic(accessory, characteristic, &slot) ||
+      slot >= cache.numEntries) {
+    return 0;
+  }
+  return cache.entries[slot].version;
+}
+
+uint32_t ValueCacheGetLatestVersion(void) {
+  return cache.version;
+}
+
+/**
+ * Stamp a changed entry with the next version.
+ */
+static void Stamp(CacheEntry *e) {
+  if (++cache.version == 0) {
+    cache.version = 1;  // 0 means never published.
+  }
+  e->version = cache.version;
+  cache.stats.numPublished++;
+}
+
+/**
+ * Look up an entry for reading. Returns NULL on a miss.
+ */
+static const CacheEntry *_Nullable Lookup(
+    const HAPAccessory *accessory, const HAPCharacteristic *characteristic,
+    HAPCharacteristicFormat format) {
+  size_t slot;
+  AttributeIndexInfo info;
+  if (!FindSlot(accessory, characteristic, format, &slot, &info)) {
+    return NULL;
+  }
+  const CacheEntry *e = &cache.entries[slot];
+  if (e->version == 0 ||
+      (info.properties & kAttributeIndexProperty_Volatile)) {
+    cache.stats.numMisses++;
+    return NULL;
+  }
+  cache.stats.numHits++;
+  return e;
+}
+
+bool ValueCachePublishBool(const HAPAccessory *accessory,
+                           const HAPCharacteristic *characteristic,
+                           bool value) {
+  CacheEntry *e =
+      FindEntry(accessory, characteristic, kHAPCharacteristicFormat_Bool);
+  if (e == NULL) {
+    return false;
+  }
+  if (e->version != 0 && e->value.b == value) {
+    return false;
+  }
+  e->value.b = value;
+  Stamp(e);
+  return true;
+}
+
+bool ValueCachePublishUInt8(const HAPAccessory *accessory,
+                            const HAPCharacteristic *characteristic,
+                            uint8_t value) {
+  CacheEntry *e =
+      FindEntry(accessory, characteristic, kHAPCharacteristicFormat_UInt8);
+  if (e == NULL) {
+    return false;
+  }
+  if (e->version != 0 && e->value.u8 == value) {
+    return false;
+  }
+  e->value.u8 = value;
+  Stamp(e);
+  return true;
+}
+
+bool ValueCachePublishUInt32(const HAPAccessory *accessory,
+                             const HAPCharacteristic *characteristic,
+                             uint32_t value) {
+  CacheEntry *e =
+      FindEntry(accessory, characteristic, kHAPCharacteristicFormat_UInt32);
+  if (e == NULL) {
+    return false;
+  }
+  if (e->version != 0 && e->value.u32 == value) {
+    return false;
+  }
+  e->value.u32 = value;
+  Stamp(e);
+  return true;
+}
+
+bool ValueCachePublishInt(const HAPAccessory *accessory,
+                          const HAPCharacteristic *characteristic,
+                          int32_t value) {
+  CacheEntry *e =
+      FindEntry(accessory, characteristic, kHAPCharacteristicFormat_Int);
+  if (e == NULL) {
+    return false;
+  }
+  if (e->version != 0 && e->value.i32 == value) {
+    return false;
+  }
+  e->value.i32 = value;
+  Stamp(e);
+  return true;
+}
+
+bool ValueCachePublishFloat(const HAPAccessory *accessory,
+                            const HAPCharacteristic *characteristic,
+                            float value) {
+  CacheEntry *e =
+      FindEntry(accessory, characteristic, kHAPCharacteristicFormat_Float);
+  if (e == NULL) {
+    return false;
+  }
+  if (e->version != 0 && e->value.f == value) {
+    return false;
+  }
+  e->value.f = value;
+  Stamp(e);
+  return true;
+}
+
+bool ValueCacheReadBool(const HAPAccessory *accessory,
+                        const HAPCharacteristic *characteristic, bool *value) {
+  HAPPrecondition(value);
+
+  const CacheEntry *e =
+      Lookup(accessory, characteristic, kHAPCharacteristicFormat_Bool);
+  if (e == NULL) {
+    return false;
+  }
+  *value = e->value.b;
+  return true;
+}
+
+bool ValueCacheReadUInt8(const HAPAccessory *accessory,
+                         const HAPCharacteristic *characteristic,
+                         uint8_t *value) {
+  HAPPrecondition(value);
+
+  const CacheEntry *e =
+      Lookup(accessory, characteristic, kHAPCharacteristicFormat_UInt8);
+  if (e == NULL) {
+    return false;
+  }
+  *value = e->value.u8;
+  return true;
+}
+
+bool ValueCacheReadUInt32(const HAPAccessory *accessory,
+                          const HAPCharacteristic *characteristic,
+                          uint32_t *value) {
+  HAPPrecondition(value);
+
+  const CacheEntry *e =
+      Lookup(accessory, characteristic, kHAPCharacteristicFormat_UInt32);
+  if (e == NULL) {
+    return false;
+  }
+  *value = e->value.u32;
+  return true;
+}
+
+bool ValueCacheReadInt(const HAPAccessory *accessory,
+                       const HAPCharacteristic *characteristic,
+                       int32_t *value) {
+  HAPPrecondition(value);
+
+  const CacheEntry *e =
+      Lookup(accessory, characteristic, kHAPCharacteristicFormat_Int);
+  if (e == NULL) {
+    return false;
+  }
+  *value = e->value.i32;
+  return true;
+}
+
+bool ValueCacheReadFloat(const HAPAccessory *accessory,
+                         const HAPCharacteristic *characteristic,
+                         float *value) {
+  HAPPrecondition(value);
+
+  const CacheEntry *e =
+      Lookup(accessory, characteristic, kHAPCharacteristicFormat_Float);
+  if (e == NULL) {
+    return false;
+  }
+  *value = e->value.f;
+  return true;
+}
+
+void ValueCacheGetStats(ValueCacheStats *stats) {
+  HAPPrecondition(stats);
+
+  *stats = cache.stats;
+}
@@ -0,0 +1,133 @@
+// Characteristic value cache.
+//
+// The app publishes characteristic values as they change, each stamped with a
+// version from a global counter, and the read handlers answer from the cache.
+// Since the accessory server reads values for event notifications and
+// multi-characteristic reads through the same handlers, all of these are
+// served without consulting the device. This lets a bridge backed by a slow
+// device (a serial or radio link) answer reads right away and refresh the
+// cache when the device reports.
+//
+// Values are kept per attribute index slot (see AttributeIndex.h), so the
+// cache must be created after the index is built. A characteristic marked
+// volatile, or one that has not been published yet, misses the cache and the
+// handler has to get the value itself.
+
+#ifndef VALUE_CACHE_H
+#define VALUE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Create the cache for the characteristics of the attribute index, replacing
+ * any previous cache. All entries start unpublished.
+ */
+void ValueCacheCreate(void);
+
+/**
+ * Free the cache.
+ */
+void ValueCacheRelease(void);
+
+/**
+ * Mark a characteristic as volatile: reads always miss the cache.
+ */
+void ValueCacheSetVolatile(const HAPAccessory *accessory,
+                           const HAPCharacteristic *characteristic,
+                           bool isVolatile);
+
+/**
+ * Version of the cached value of a characteristic, 0 if never published.
+ * Versions increase with every change across the whole cache, so a client can
+ * tell which values changed since it last looked.
+ */
+uint32_t ValueCacheGetVersion(const HAPAccessory *accessory,
+                              const HAPCharacteristic *characteristic);
+
+/**
+ * Latest version published.
+ */
+uint32_t ValueCacheGetLatestVersion(void);
+
+/**
+ * Publish a value. The characteristic format must match. Before the cache
+ * has been created (the accessory server is not running) this does nothing.
+ *
+ * @return true if the value changed, false otherwise.
+ */
+/**@{*/
+bool ValueCachePublishBool(const HAPAccessory *accessory,
+                           const HAPCharacteristic *characteristic, bool value);
+bool ValueCachePublishUInt8(const HAPAccessory *accessory,
+                            const HAPCharacteristic *characteristic,
+                            uint8_t value);
+bool ValueCachePublishUInt32(const HAPAccessory *accessory,
+                             const HAPCharacteristic *characteristic,
+                             uint32_t value);
+bool ValueCachePublishInt(const HAPAccessory *accessory,
+                          const HAPCharacteristic *characteristic,
+                          int32_t value);
+bool ValueCachePublishFloat(const HAPAccessory *accessory,
+                            const HAPCharacteristic *characteristic,
+                            float value);
+/**@}*/
+
+/**
+ * Read a value from the cache. The characteristic format must match.
+ *
+ * @return true on a hit, false if the value is volatile or unpublished, or
+ *         the cache has not been created.
+ */
+/**@{*/
+HAP_RESULT_USE_CHECK
+bool ValueCacheReadBool(const HAPAccessory *accessory,
+                        const HAPCharacteristic *characteristic, bool *value);
+HAP_RESULT_USE_CHECK
+bool ValueCacheReadUInt8(const HAPAccessory *accessory,
+                         const HAPCharacteristic *characteristic,
+                         uint8_t *value);
+HAP_RESULT_USE_CHECK
+bool ValueCacheReadUInt32(const HAPAccessory *accessory,
+                          const HAPCharacteristic *characteristic,
+                          uint32_t *value);
+HAP_RESULT_USE_CHECK
+bool ValueCacheReadInt(const HAPAccessory *accessory,
+                       const HAPCharacteristic *characteristic,
+                       int32_t *value);
+HAP_RESULT_USE_CHECK
+bool ValueCacheReadFloat(const HAPAccessory *accessory,
+                         const HAPCharacteristic *characteristic,
+                         float *value);
+/**@}*/
+
+/**
+ * Cache counters.
+ */
+typedef struct {
+  uint32_t numHits;
+  uint32_t numMisses;
+  uint32_t numPublished;  // Publish calls that changed a value.
+} ValueCacheStats;
+
+/**
+ * Get cache counters.
+ */
+void ValueCacheGetStats(ValueCacheStats *stats);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,119 @@
+// Write batching.
+
+#include "WriteBatch.h"
+
+#include "mgos.h"
+
+typedef struct {
+  WriteBatchTransaction transaction;
+  WriteBatchCommitCallback callback;
+  void *_Nullable context;
+} PendingTransaction;
+
+static struct {
+  HAPAccessoryServerRef *_Nullable server;
+  PendingTransaction pending[kWriteBatch_MaxTransactions];
+  size_t numPending;
+  bool flushScheduled;
+  bool flushing;
+  WriteBatchStats stats;
+} batch;
+
+static void WriteBatchFlushCallback(void *arg HAP_UNUSED) {
+  batch.flushScheduled = false;
+  WriteBatchFlush();
+}
+
+static void Commit(HAPAccessoryServerRef *server, PendingTransaction *p) {
+  p->callback(server, &p->transaction, p->context);
+  batch.stats.numCommits++;
+}
+
+void WriteBatchAdd(HAPAccessoryServerRef *server,
+                   const HAPAccessory *accessory, const HAPService *service,
+                   const HAPCharacteristic *characteristic,
+                   WriteBatchCommitCallback callback,
+                   void *_Nullable context) {
+  HAPPrecondition(server);
+  HAPPrecondition(accessory);
+  HAPPrecondition(service);
+  HAPPrecondition(characteristic);
+  HAPPrecondition(callback);
+
+  batch.stats.numWrites++;
+  // Writes staged by a commit callback commit right away, so that the pending
+  // transactions do not change while they are being committed.
+  if (!mgos_sys_config_get_app_write_batch() || batch.flushing) {
+    PendingTransaction p = {
+        .transaction = {.accessory = accessory,
+                        .service = service,
+                        .characteristics = {characteristic},
+                        .numCharacteristics = 1},
+        .callback = callback,
+        .context = context};
+    Commit(server, &p);
+    return;
+  }
+  if (batch.server != server) {
+    WriteBatchFlush();
+    batch.server = server;
+  }
+
+  PendingTransaction *p = NULL;
+  for (size_t i = 0; i < batch.numPending; i++) {
+    PendingTransaction *q = &batch.pending[i];
+    if (q->transaction.accessory == accessory &&
+        q->transaction.service == service && q->callback == callback &&
+        q->context == context) {
+      p = q;
+      break;
+    }
+  }
+  if (p != NULL &&
+      p->transaction.numCharacteristics == kWriteBatch_MaxCharacteristics) {
+    WriteBatchFlush();
+    p = NULL;
+  }
+  if (p == NULL) {
+    if (batch.numPending == kWriteBatch_MaxTransactions) {
+      WriteBatchFlush();
+    }
+    p = &batch.pending[batch.numPending++];
+    *p = (PendingTransaction){
+        .transaction = {.accessory = accessory, .service = service},
+        .callback = callback,
+        .context = context};
+  }
+  WriteBatchTransaction *t = &p->transaction;
+  for (size_t i = 0; i < t->numCharacteristics; i++) {
+    if (t->characteristics[i] == characteristic) {
+      return;  // Written twice in one request, the state has the last value.
+    }
+  }
+  t->characteristics[t->numCharacteristics++] = characteristic;
+
+  if (!batch.flushScheduled) {
+    batch.flushScheduled = true;
+    mgos_invoke_cb(WriteBatchFlushCallback, NULL, false);
+  }
+}
+
+void WriteBatchFlush(void) {
+  if (batch.flushing) {
+    return;
+  }
+  // Commit in place; this can run inside a write handler, where the stack is
+  // shared with the accessory server.
+  batch.flushing = true;
+  for (size_t i = 0; i < batch.numPending; i++) {
+    Commit(batch.server, &batch.pending[i]);
+  }
+  batch.numPending = 0;
+  batch.flushing = false;
+}
+
+void WriteBatchGetStats(WriteBatchStats *stats) {
+  HAPPrecondition(stats);
+
+  *stats = batch.stats;
+}
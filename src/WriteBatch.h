@@ -0,0 +1,92 @@
+// Write batching.
+//
+// A PUT /characteristics request can carry many characteristics, and the
+// accessory server calls their write handlers one at a time. Handlers that
+// opt in only apply the new value to the app state and stage the write here;
+// the writes are grouped per service and committed together once the request
+// has been handled, so the service's backend is driven once, the state is
+// persisted once and the events go out together.
+//
+// The commit runs from the main loop right after the current request (see
+// mgos_invoke_cb). With app.write_batch set to false every write commits
+// right away, which is the per-characteristic behavior.
+
+#ifndef WRITE_BATCH_H
+#define WRITE_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * Maximum number of services with staged writes. When exceeded, staged writes
+ * are committed early.
+ */
+#define kWriteBatch_MaxTransactions ((size_t) 16)
+
+/**
+ * Maximum number of characteristics per transaction.
+ */
+#define kWriteBatch_MaxCharacteristics ((size_t) 8)
+
+/**
+ * Writes to one service of one accessory.
+ */
+typedef struct {
+  const HAPAccessory *accessory;
+  const HAPService *service;
+  const HAPCharacteristic *characteristics[kWriteBatch_MaxCharacteristics];
+  size_t numCharacteristics;
+} WriteBatchTransaction;
+
+/**
+ * Commit a transaction: drive the backend, persist, raise events.
+ */
+typedef void (*WriteBatchCommitCallback)(
+    HAPAccessoryServerRef *server, const WriteBatchTransaction *transaction,
+    void *_Nullable context);
+
+/**
+ * Batch counters.
+ */
+typedef struct {
+  uint32_t numWrites;   // Staged writes.
+  uint32_t numCommits;  // Transactions committed.
+} WriteBatchStats;
+
+/**
+ * Stage a write that has been applied to the app state. Writes to the same
+ * service with the same callback are committed together. A write staged from
+ * a commit callback is committed right away.
+ */
+void WriteBatchAdd(HAPAccessoryServerRef *server,
+                   const HAPAccessory *accessory, const HAPService *service,
+                   const HAPCharacteristic *characteristic,
+                   WriteBatchCommitCallback callback, void *_Nullable context);
+
+/**
+ * Commit all staged writes now. Does nothing when called from a commit
+ * callback.
+ */
+void WriteBatchFlush(void);
+
+/**
+ * Get batch counters.
+ */
+void WriteBatchGetStats(WriteBatchStats *stats);
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
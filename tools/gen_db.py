@@ -0,0 +1,355 @@
+#!/usr/bin/env python3
+#
+# Generates the attribute database (src/DB.h, src/DB.c) from its declarative
+# description (src/DB.json).
+#
+# IIDs are assigned deterministically: each service has a base IID and its
+# characteristics follow it in order. Attribute counts are derived from the
+# description, so there is nothing to count by hand. All generated objects are
+# const, so they end up in flash and cost nothing at startup.
+#
+#   tools/gen_db.py [--check]
+#
+# With --check, fails if the checked-in files are out of date.
+
+import argparse
+import json
+import os
+import sys
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+SRC = os.path.join(ROOT, "src")
+
+COPYRIGHT = """\
+// Copyright (c) 2015-2019 The HomeKit ADK Contributors
+//
+// Licensed under the Apache License, Version 2.0 (the “License”);
+// you may not use this file except in compliance with the License.
+// See [CONTRIBUTORS.md] for the list of HomeKit ADK project authors.
+"""
+
+GENERATED = "// Generated by tools/gen_db.py from DB.json. Do not edit.\n"
+
+SEPARATOR = "/" * 120
+
+PROPERTIES = ["readable", "writable", "supportsEventNotification", "hidden",
+              "requiresTimedWrite", "supportsAuthorizationData"]
+IP_PROPERTIES = ["controlPoint", "supportsWriteResponse"]
+BLE_PROPERTIES = ["supportsBroadcastNotification",
+                  "supportsDisconnectedNotification",
+                  "readableWithoutSecurity", "writableWithoutSecurity"]
+
+NUMERIC_FORMATS = {"UInt8", "UInt16", "UInt32", "UInt64", "Int", "Float"}
+VALID_FORMATS = NUMERIC_FORMATS | {"Bool", "String", "Data", "TLV8"}
+
+
+def lower_first(s):
+    return s[0].lower() + s[1:]
+
+
+def c_bool(v):
+    return "true" if v else "false"
+
+
+def c_number(v):
+    if isinstance(v, float):
+        return "%sf" % repr(v)
+    return str(v)
+
+
+def wrap_sum(terms):
+    """Formats a parenthesized sum as a macro body wrapped at 80 columns."""
+    lines = []
+    line = "  ("
+    for i, term in enumerate(terms):
+        sep = " + " if i > 0 else ""
+        if i > 0 and len(line + sep + term) > 76:
+            lines.append(line + " +")
+            line = "   "
+            sep = ""
+        line += sep + term
+    lines.append(line + ")")
+    return "".join("%s \\\n" % l.ljust(77) for l in lines[:-1]) + \
+        lines[-1] + "\n"
+
+
+def validate(db):
+    iids = set()
+    for svc in db["services"]:
+        chars = svc["characteristics"]
+        for iid in range(svc["iid"], svc["iid"] + 1 + len(chars)):
+            if iid in iids:
+                sys.exit("Duplicate IID %d in service %s" % (iid, svc["name"]))
+            iids.add(iid)
+        for c in chars:
+            what = "%s.%s" % (svc["name"], c["name"])
+            if c["format"] not in VALID_FORMATS:
+                sys.exit("%s: unknown format %s" % (what, c["format"]))
+            props = set(c.get("properties", []))
+            if not props <= set(PROPERTIES):
+                sys.exit("%s: unknown properties %s" %
+                         (what, props - set(PROPERTIES)))
+            if "readable" in props and "read" not in c:
+                sys.exit("%s: readable but no read handler" % what)
+            if "writable" in props and "write" not in c:
+                sys.exit("%s: writable but no write handler" % what)
+            if ("supportsEventNotification" in props and
+                    "readable" not in props):
+                sys.exit("%s: events require readable" % what)
+
+
+def iid_name(svc, c=None):
+    return "kIID_%s%s" % (svc["name"], c["name"] if c else "")
+
+
+def char_var(svc, c):
+    return "%s%sCharacteristic" % (lower_first(svc["name"]), c["name"])
+
+
+def chars_var(svc):
+    return "%sCharacteristics" % lower_first(svc_var(svc))
+
+
+def svc_var(svc):
+    return "%sService" % lower_first(svc["name"])
+
+
+def gen_characteristic(svc, c):
+    props = set(c.get("properties", []))
+    ip = set(c.get("ip", []))
+    ble = set(c.get("ble", []))
+    fmt = c["format"]
+    out = []
+    out.append("/**\n * The '%s' characteristic of the %s service.\n */\n" %
+               (c["title"], svc["title"]))
+    out.append("%sconst HAP%sCharacteristic %s = {\n" %
+               ("" if c.get("public") else "static ", fmt, char_var(svc, c)))
+    out.append("    .format = kHAPCharacteristicFormat_%s,\n" % fmt)
+    out.append("    .iid = %s,\n" % iid_name(svc, c))
+    out.append("    .characteristicType = &kHAPCharacteristicType_%s,\n" %
+               c["type"])
+    out.append("    .debugDescription = "
+               "kHAPCharacteristicDebugDescription_%s,\n" % c["type"])
+    out.append("    .manufacturerDescription = NULL,\n")
+    out.append("    .properties = {")
+    out.append(",\n                   ".join(
+        ".%s = %s" % (p, c_bool(p in props)) for p in PROPERTIES))
+    out.append(",\n                   .ip = {%s}" %
+               ",\n                          ".join(
+                   ".%s = %s" % (p, c_bool(p in ip)) for p in IP_PROPERTIES))
+    out.append(",\n                   .ble = {%s}},\n" %
+               ",\n                           ".join(
+                   ".%s = %s" % (p, c_bool(p in ble))
+                   for p in BLE_PROPERTIES))
+    if "units" in c:
+        out.append("    .units = kHAPCharacteristicUnits_%s,\n" % c["units"])
+    if "constraints" in c:
+        out.append("    .constraints = {%s},\n" %
+                   ",\n                    ".join(
+                       ".%s = %s" % (k, c_number(v))
+                       for k, v in c["constraints"].items()))
+    out.append("    .callbacks = {.handleRead = %s,\n"
+               "                  .handleWrite = %s}};\n" %
+               (c.get("read", "NULL"), c.get("write", "NULL")))
+    return "".join(out)
+
+
+def static_assert(lhs, op, rhs, name):
+    """Formats a HAP_STATIC_ASSERT the way clang-format would."""
+    head = "HAP_STATIC_ASSERT("
+    indent = " " * len(head)
+    cond = "%s %s %s," % (lhs, op, rhs)
+    if len(head + cond) <= 80:
+        cond_lines = [head + cond]
+    else:
+        cond_lines = [head + "%s %s" % (lhs, op), indent + "    " + rhs + ","]
+    if len(cond_lines) == 1 and len(cond_lines[0] + " " + name + ");") <= 80:
+        return cond_lines[0] + " " + name + ");\n"
+    return "\n".join(cond_lines + [indent + name + ");"]) + "\n"
+
+
+def gen_characteristics_array(svc):
+    out = []
+    out.append("/**\n * Characteristics of the %s service.\n */\n" %
+               svc["title"])
+    out.append("static const HAPCharacteristic *const %s[] = {\n" %
+               chars_var(svc))
+    out.append("".join("    &%s,\n" % char_var(svc, c)
+                       for c in svc["characteristics"]))
+    out.append("    NULL};\n")
+    # The NULL terminator takes the place of the service itself.
+    out.append(static_assert("HAPArrayCount(%s)" % chars_var(svc), "==",
+                             "kAttributeCount_%s" % svc["name"],
+                             "kAttributeCount_%s_mismatch" % svc["name"]))
+    return "".join(out)
+
+
+def gen_iid_asserts(db):
+    # Strictly increasing IIDs are unique IIDs.
+    iids = []
+    for svc in db["services"]:
+        iids.append(iid_name(svc))
+        iids.extend(iid_name(svc, c) for c in svc["characteristics"])
+    out = ["/**\n * IIDs must be unique. They are allocated in increasing "
+           "order.\n */\n"]
+    for prev, cur in zip(iids, iids[1:]):
+        out.append(static_assert(cur, ">", prev, "%s_order" % cur))
+    return "".join(out)
+
+
+def gen_service(svc):
+    out = []
+    out.append("/**\n * The %s service.\n */\n" % svc["title"])
+    out.append("const HAPService %s = {\n" % svc_var(svc))
+    out.append("    .iid = %s,\n" % iid_name(svc))
+    out.append("    .serviceType = &kHAPServiceType_%s,\n" % svc["type"])
+    out.append("    .debugDescription = kHAPServiceDebugDescription_%s,\n" %
+               svc["type"])
+    if svc.get("nameMacro"):
+        out.append("    // The actual name is served by the Name read "
+                   "handler.\n")
+        out.append("    .name = CS_STRINGIFY_MACRO(%s),\n" % svc["nameMacro"])
+    else:
+        out.append("    .name = NULL,\n")
+    out.append("    .properties = {.primaryService = %s,\n"
+               "                   .hidden = %s,\n"
+               "                   .ble = {.supportsConfiguration = false}},"
+               "\n" %
+               (c_bool(svc.get("primary")), c_bool(svc.get("hidden"))))
+    out.append("    .linkedServices = NULL,\n")
+    out.append("    .characteristics = %s};\n" % chars_var(svc))
+    return "".join(out)
+
+
+def gen_header(db):
+    out = [COPYRIGHT, "\n", GENERATED, "\n"]
+    out.append("""\
+// Attribute database of the light bulb. This header file, and the
+// corresponding DB.c implementation, is platform-independent.
+
+#ifndef DB_H
+#define DB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "HAP.h"
+
+#if __has_feature(nullability)
+#pragma clang assume_nonnull begin
+#endif
+
+/**
+ * IID constants.
+ */
+""")
+    for svc in db["services"]:
+        out.append("#define %s ((uint64_t) 0x%04X)\n" %
+                   (iid_name(svc), svc["iid"]))
+        for i, c in enumerate(svc["characteristics"]):
+            out.append("#define %s ((uint64_t) 0x%04X)\n" %
+                       (iid_name(svc, c), svc["iid"] + 1 + i))
+    out.append("""
+/**
+ * Number of attributes (the service plus its characteristics) of each service.
+ */
+""")
+    names = []
+    for svc in db["externalServices"]:
+        out.append("#define kAttributeCount_%s ((size_t) %d)\n" %
+                   (svc["name"], svc["attributes"]))
+        names.append(svc["name"])
+    for svc in db["services"]:
+        out.append("#define kAttributeCount_%s ((size_t) %d)\n" %
+                   (svc["name"], 1 + len(svc["characteristics"])))
+        names.append(svc["name"])
+    out.append("""
+/**
+ * Total number of services and characteristics contained in the standalone
+ * accessory. In bridge mode the count depends on the bridge table, see
+ * AppGetAttributeCount.
+ */
+""")
+    out.append("%s \\\n" % "#define kAttributeCount".ljust(77))
+    out.append(wrap_sum(["kAttributeCount_%s" % n for n in names]))
+    for svc in db["services"]:
+        comment = (" " + svc["comment"]) if "comment" in svc else ""
+        out.append("\n/**\n * %s service.%s\n */\n" % (svc["title"], comment))
+        out.append("extern const HAPService %s;\n" % svc_var(svc))
+        for c in svc["characteristics"]:
+            if c.get("public"):
+                out.append("\n/**\n * The '%s' characteristic of the %s "
+                           "service.\n */\n" % (c["title"], svc["title"]))
+                out.append("extern const HAP%sCharacteristic %s;\n" %
+                           (c["format"], char_var(svc, c)))
+    out.append("""
+#if __has_feature(nullability)
+#pragma clang assume_nonnull end
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+""")
+    return "".join(out)
+
+
+def gen_source(db):
+    out = [COPYRIGHT, "\n", GENERATED, "\n"]
+    out.append("""\
+// This file contains the accessory attribute database: the services and
+// characteristics exposed by the light bulb. The accessory information, HAP
+// Protocol Information and Pairing services are provided by mgos_hap.
+
+#include "DB.h"
+#include "App.h"
+
+#include "mgos.h"
+
+%s
+
+""" % SEPARATOR)
+    out.append(gen_iid_asserts(db))
+    for svc in db["services"]:
+        for c in svc["characteristics"]:
+            out.append("\n")
+            out.append(gen_characteristic(svc, c))
+        out.append("\n")
+        out.append(gen_characteristics_array(svc))
+        out.append("\n")
+        out.append(gen_service(svc))
+    return "".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Generate the attribute database from DB.json.")
+    parser.add_argument("--check", action="store_true",
+                        help="Fail if the generated files are out of date")
+    args = parser.parse_args()
+
+    with open(os.path.join(SRC, "DB.json")) as f:
+        db = json.load(f)
+    validate(db)
+
+    stale = False
+    for name, text in (("DB.h", gen_header(db)), ("DB.c", gen_source(db))):
+        path = os.path.join(SRC, name)
+        old = open(path).read() if os.path.exists(path) else None
+        if old == text:
+            continue
+        if args.check:
+            print("%s is out of date" % name)
+            stale = True
+        else:
+            with open(path, "w") as f:
+                f.write(text)
+            print("Wrote %s" % path)
+    sys.exit(1 if stale else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+#
+# Loopback HAP controller for load testing the accessory.
+#
+# Pairs with the accessory once (the pairing is kept in a file) and then issues
+# GET and/or PUT /characteristics requests as fast as possible, reporting
+# throughput and latency percentiles.
+#
+# Requires the homekit package: pip3 install homekit
+#
+# Example, against the host build:
+#   tools/hap_bench.py --device-id XX:XX:XX:XX:XX:XX --pin 111-22-333 \
+#       --mode mixed --requests 10000
+#
+# With --controllers N, N threads each open their own session and run the
+# requests concurrently. --mode churn opens and closes a session per request,
+# which is the soak test for the heap profiler (App.HeapProfile).
+# --verify-load N runs N extra controllers that keep reconnecting, to measure
+# how pair-verify on the run loop affects the latency of established sessions.
+# --chars N reads or writes the first N characteristics of the light bulb
+# service (On, Brightness, Hue, Saturation, Color Temperature) in each
+# request, --lights M does so for M consecutive accessories. Against a bridge
+# with app.write_batch on and off this compares batched and per-characteristic
+# write commits, e.g. a 20-characteristic PUT:
+#   tools/hap_bench.py --aid 2 --lights 4 --chars 5 --mode put --metrics
+#
+# --metrics reads App.Metrics with mos (--mos-port selects the device) before
+# and after the run and reports what the accessory counted in between: state
+# saves, i.e. flash writes, and the write handler latency. To measure the cost
+# of persisting each toggle, toggle the light 10000 times with different
+# lightbulb.save_delay_ms settings:
+#   tools/hap_bench.py --mode put --requests 10000 --metrics
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+
+from homekit.controller import Controller
+
+# aid.iid of the light bulb's "On" characteristic, see src/DB.c.
+DEFAULT_AID = 1
+DEFAULT_IID = 0x33
+
+# Writable characteristics of the light bulb service in iid order, from On,
+# with the two values a put alternates between. See src/DB.json.
+LIGHT_BULB_VALUES = [
+    (False, True),  # On.
+    (50, 100),      # Brightness.
+    (120, 240),     # Hue.
+    (50, 100),      # Saturation.
+    (200, 400),     # Color Temperature.
+]
+
+
+def load_controller(args):
+    controller = Controller()
+    if os.path.exists(args.pairing_file):
+        controller.load_data(args.pairing_file)
+    if args.alias not in controller.get_pairings():
+        if not args.device_id or not args.pin:
+            sys.exit("Not paired yet, --device-id and --pin are required")
+        print("Pairing with %s..." % args.device_id)
+        start = time.perf_counter()
+        controller.perform_pairing(args.alias, args.device_id, args.pin)
+        print("Paired in %.2f s" % (time.perf_counter() - start))
+        controller.save_data(args.pairing_file)
+    return controller
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    i = min(len(sorted_values) - 1, int(len(sorted_values) * p / 100.0))
+    return sorted_values[i]
+
+
+def churn(args):
+    """Opens a new session for every request and closes it afterwards."""
+    chars = [(args.aid, args.iid)]
+    latencies = []
+    for i in range(args.requests):
+        start = time.perf_counter()
+        controller = Controller()
+        controller.load_data(args.pairing_file)
+        pairing = controller.get_pairings()[args.alias]
+        pairing.get_characteristics(chars)
+        pairing.close()
+        latencies.append(time.perf_counter() - start)
+    return latencies
+
+
+def run(pairing, args):
+    if args.mode == "churn":
+        return churn(args)
+    chars = [(args.aid + light, args.iid + k)
+             for light in range(args.lights) for k in range(args.chars)]
+    latencies = []
+    step = 0
+    for i in range(args.requests):
+        put = args.mode == "put" or (args.mode == "mixed" and i % 2 == 1)
+        start = time.perf_counter()
+        if put:
+            step ^= 1
+            pairing.put_characteristics(
+                [(aid, iid, LIGHT_BULB_VALUES[iid - args.iid][step])
+                 for aid, iid in chars])
+        else:
+            pairing.get_characteristics(chars)
+        latencies.append(time.perf_counter() - start)
+    return latencies
+
+
+def get_metrics(args):
+    cmd = ["mos"]
+    if args.mos_port:
+        cmd += ["--port", args.mos_port]
+    return json.loads(subprocess.check_output(cmd + ["call", "App.Metrics"]))
+
+
+def histogram_percentile(buckets, p):
+    """Upper bound in us of the power-of-2 bucket holding percentile p."""
+    total = sum(buckets)
+    if total == 0:
+        return 0
+    seen = 0
+    for i, n in enumerate(buckets):
+        seen += n
+        if seen * 100.0 >= total * p:
+            return 1 << i
+    return 1 << (len(buckets) - 1)
+
+
+def report_metrics(before, after):
+    counter = lambda name: after["counters"][name] - before["counters"][name]
+    histogram = lambda name: [
+        a - b for a, b in zip(after["histograms"][name],
+                              before["histograms"][name])]
+    writes = counter("writes")
+    saves = counter("state_saves")
+    print("accessory: %d writes, %d state saves (%d bytes), "
+          "%.2f saves per 1000 writes" %
+          (writes, saves, counter("state_save_bytes"),
+           saves * 1000.0 / writes if writes else 0.0))
+    batched = (after["write_batch"]["writes"] -
+               before["write_batch"]["writes"])
+    commits = (after["write_batch"]["commits"] -
+               before["write_batch"]["commits"])
+    print("  write batch: %d writes in %d commits, %.2f per commit" %
+          (batched, commits, batched / float(commits) if commits else 0.0))
+    for name in ("write_us", "state_save_us"):
+        buckets = histogram(name)
+        print("  %s: %d samples, p50 < %d  p90 < %d  p99 < %d" %
+              (name, sum(buckets), histogram_percentile(buckets, 50),
+               histogram_percentile(buckets, 90),
+               histogram_percentile(buckets, 99)))
+
+
+def report(name, latencies, elapsed):
+    latencies.sort()
+    ms = lambda s: s * 1000.0
+    print("%s: %d requests in %.2f s, %.1f req/s" %
+          (name, len(latencies), elapsed, len(latencies) / elapsed))
+    print("  latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f" %
+          (ms(percentile(latencies, 50)), ms(percentile(latencies, 90)),
+           ms(percentile(latencies, 99)), ms(latencies[-1])))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Loopback HAP controller for load testing.")
+    parser.add_argument("--pairing-file", default="hap_bench_pairing.json")
+    parser.add_argument("--alias", default="bench")
+    parser.add_argument("--device-id", help="Accessory device id (from mDNS)")
+    parser.add_argument("--pin", help="Setup code, e.g. 111-22-333")
+    parser.add_argument("--aid", type=int, default=DEFAULT_AID)
+    parser.add_argument("--iid", type=lambda v: int(v, 0), default=DEFAULT_IID)
+    parser.add_argument("--mode", choices=["get", "put", "mixed", "churn"],
+                        default="get",
+                        help="churn connects, reads and disconnects each time")
+    parser.add_argument("--chars", type=int, default=1,
+                        choices=range(1, len(LIGHT_BULB_VALUES) + 1),
+                        help="Characteristics of the light bulb service per "
+                        "light and request, from On (--iid)")
+    parser.add_argument("--lights", type=int, default=1,
+                        help="Lights per request, consecutive accessories "
+                        "starting at --aid")
+    parser.add_argument("--requests", type=int, default=1000,
+                        help="Requests per controller")
+    parser.add_argument("--controllers", type=int, default=1,
+                        help="Number of concurrent sessions")
+    parser.add_argument("--verify-load", type=int, default=0,
+                        help="Background threads reconnecting (pair-verify) "
+                        "in a loop while the measurement runs")
+    parser.add_argument("--metrics", action="store_true",
+                        help="Report state saves and write handler latency "
+                        "from App.Metrics (needs mos)")
+    parser.add_argument("--mos-port", help="Device port for mos, e.g. "
+                        "/dev/ttyUSB0")
+    parser.add_argument("--save-wait", type=float, default=3.0,
+                        help="Seconds to wait for pending state saves before "
+                        "reading App.Metrics after the run")
+    args = parser.parse_args()
+
+    load_controller(args)
+
+    # Each controller gets its own Controller object and hence its own session.
+    pairings = []
+    for _ in range(args.controllers):
+        controller = Controller()
+        controller.load_data(args.pairing_file)
+        pairing = controller.get_pairings()[args.alias]
+        pairing.get_characteristics([(args.aid, args.iid)])  # Open session.
+        pairings.append(pairing)
+
+    results = [None] * len(pairings)
+    stop = threading.Event()
+
+    def worker(i):
+        results[i] = run(pairings[i], args)
+
+    def verify_load():
+        # Keeps the accessory busy with pair-verify by reconnecting in a loop.
+        while not stop.is_set():
+            churn(argparse.Namespace(**dict(vars(args), requests=1)))
+
+    loaders = [threading.Thread(target=verify_load)
+               for _ in range(args.verify_load)]
+    for t in loaders:
+        t.start()
+
+    threads = [threading.Thread(target=worker, args=(i,))
+               for i in range(len(pairings))]
+    metrics_before = get_metrics(args) if args.metrics else None
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+    stop.set()
+    for t in loaders:
+        t.join()
+
+    if len(results) > 1:
+        for i, latencies in enumerate(results):
+            report("controller %d" % i, list(latencies), elapsed)
+    report("%s x%d" % (args.mode, len(results)),
+           [l for latencies in results for l in latencies], elapsed)
+    if args.metrics:
+        # Let the save timer write out the last change first.
+        time.sleep(args.save_wait)
+        report_metrics(metrics_before, get_metrics(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# Batch provisioning of HomeKit setup codes for the factory line.
+#
+# Pair setup uses an SRP-6a salt and verifier derived from the setup code.
+# Deriving the verifier is a 3072-bit modular exponentiation, which takes
+# seconds on an ESP8266, so instead of sending the code to the device
+# (HAP.Setup) the records are generated here ahead of time and the device only
+# stores the result:
+#
+#   tools/hap_provision.py gen --count 1000 --out records.csv
+#   tools/hap_provision.py apply --records records.csv [--port /dev/ttyUSB0]
+#
+# "apply" takes the next unused record, writes hap.salt and hap.verifier to the
+# device, marks the record as used and prints the setup code for the label.
+
+import argparse
+import base64
+import csv
+import hashlib
+import os
+import secrets
+import subprocess
+import sys
+import time
+
+# RFC 5054 3072-bit group, as used by HAP pair setup.
+N = int(
+    "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+    "020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+    "4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+    "EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+    "98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+    "9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+    "E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+    "3995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33"
+    "A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+    "ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864"
+    "D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E2"
+    "08E24FA074E5AB3143DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFF", 16)
+G = 5
+N_BYTES = 384
+USERNAME = b"Pair-Setup"
+
+# Codes HomeKit rejects as trivial.
+INVALID_CODES = {
+    "000-00-000", "111-11-111", "222-22-222", "333-33-333", "444-44-444",
+    "555-55-555", "666-66-666", "777-77-777", "888-88-888", "999-99-999",
+    "123-45-678", "876-54-321",
+}
+
+FIELDS = ["code", "salt", "verifier", "used"]
+
+
+def random_code():
+    while True:
+        digits = "%08d" % secrets.randbelow(10 ** 8)
+        code = "%s-%s-%s" % (digits[:3], digits[3:5], digits[5:])
+        if code not in INVALID_CODES:
+            return code
+
+
+def make_verifier(code, salt):
+    inner = hashlib.sha512(USERNAME + b":" + code.encode()).digest()
+    x = int.from_bytes(hashlib.sha512(salt + inner).digest(), "big")
+    return pow(G, x, N).to_bytes(N_BYTES, "big")
+
+
+def gen(args):
+    if os.path.exists(args.out) and not args.force:
+        sys.exit("%s exists, use --force to overwrite" % args.out)
+    start = time.perf_counter()
+    with open(args.out, "w", newline="") as f:
+        w = csv.DictWriter(f, fieldnames=FIELDS)
+        w.writeheader()
+        for _ in range(args.count):
+            code = random_code()
+            salt = secrets.token_bytes(16)
+            w.writerow({
+                "code": code,
+                "salt": base64.b64encode(salt).decode(),
+                "verifier": base64.b64encode(make_verifier(code,
+                                                           salt)).decode(),
+                "used": "",
+            })
+    elapsed = time.perf_counter() - start
+    print("%d records in %.2f s (%.1f ms each)" %
+          (args.count, elapsed, elapsed * 1000.0 / max(args.count, 1)))
+
+
+def mos(args, *cmd):
+    argv = ["mos"] + (["--port", args.port] if args.port else []) + list(cmd)
+    subprocess.run(argv, check=True, stdout=subprocess.DEVNULL)
+
+
+def apply(args):
+    with open(args.records, newline="") as f:
+        records = list(csv.DictReader(f))
+    record = next((r for r in records if not r["used"]), None)
+    if record is None:
+        sys.exit("No unused records left in %s" % args.records)
+
+    start = time.perf_counter()
+    mos(args, "call", "Config.Set",
+        '{"config": {"hap": {"salt": "%s", "verifier": "%s"}}}' %
+        (record["salt"], record["verifier"]))
+    mos(args, "call", "Config.Save", '{"reboot": true}')
+    elapsed = time.perf_counter() - start
+
+    # Only mark the record as used once the device has it.
+    record["used"] = time.strftime("%Y-%m-%dT%H:%M:%S")
+    with open(args.records + ".tmp", "w", newline="") as f:
+        w = csv.DictWriter(f, fieldnames=FIELDS)
+        w.writeheader()
+        w.writerows(records)
+    os.replace(args.records + ".tmp", args.records)
+    print("Provisioned in %.2f s, setup code: %s" % (elapsed, record["code"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Batch provisioning of HomeKit setup codes.")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("gen", help="Generate setup code records")
+    p.add_argument("--count", type=int, default=100)
+    p.add_argument("--out", default="records.csv")
+    p.add_argument("--force", action="store_true")
+    p.set_defaults(func=gen)
+    p = sub.add_parser("apply", help="Provision the next record to a device")
+    p.add_argument("--records", default="records.csv")
+    p.add_argument("--port", help="Device port, passed to mos")
+    p.set_defaults(func=apply)
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()